@@ -0,0 +1,938 @@
+/*
+ * File: claim.c
+ *
+ * Claiming of mail files, so that several copies of the program can share
+ * the same spool directories.
+ *
+ * Before a file is opened, it is claimed by moving it into a work area of
+ * this process's own, below the directory it is in: WORKDIR\nnnnnnnn,
+ * where nnnnnnnn is the process ID in hexadecimal. Only one process can
+ * succeed in moving a file, so no file is ever sent by two at once; and a
+ * file being sent is no longer in the spool directory itself, so other
+ * processes do not even see it. When the file has been sent, it is removed
+ * from the work area; if it is to be tried again, it is moved back.
+ *
+ * A process that stops without tidying up (because it was killed, say)
+ * leaves its files in its work area. So each work area holds a lease
+ * file, hidden so that it is not taken for mail, giving the last time the
+ * process showed that it was still running; a thread of its own renews
+ * this every RENEWTIME. Any process that finds a work area whose lease has
+ * not been renewed for LEASETIME moves the files in it back to the spool
+ * directory, and removes it. A process also returns any files left in its
+ * own work area (from an earlier process with the same ID) when it starts.
+ *
+ * A file that has been sent is not removed at once. Instead its name is
+ * added to a list, and a thread of its own writes the names on that list
+ * to a journal in the work area (a hidden file), waits for them to reach
+ * the disk, and only then removes the files. Names are written in groups,
+ * once COMMITCOUNT have been sent or COMMITTIME after the first of them,
+ * so that the disk is waited for only once for many messages, and the
+ * connections sending mail do not wait for it at all. Once the files are
+ * removed the journal is emptied again; no file is claimed while this is
+ * being done, as a new file of the same name as one of those removed
+ * could otherwise be taken for it. The files named in the journal
+ * of a work area are removed, rather than returned, when the files in the
+ * area are returned to the spool directory; so a message that was sent
+ * just before a process stopped is not sent again.
+ *
+ * The subdirectories of a fanned out spool directory share the work area
+ * of the directory itself, so that there is only one lease and one
+ * journal to keep for all of them. A file claimed from a subdirectory x\y
+ * keeps that path below the work area, and goes back to the same place.
+ *
+ * Only files found in the spool directories are claimed; files named
+ * explicitly are sent where they are, and removed at once when sent.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#pragma	strings(readonly)
+
+#pragma	alloc_text(a_init_seg, claim_start)
+#pragma	alloc_text(a_init_seg, start_reaper)
+
+#define	INCL_DOSERRORS
+#define	INCL_DOSFILEMGR
+#define	INCL_DOSPROCESS
+#define	INCL_DOSSEMAPHORES
+#define	OS2
+#include <os2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtp.h"
+#include "claim.h"
+
+#define	WORKDIR		"WORK"		/* Directory holding the work areas,
+					   in each spool directory */
+#define	LEASEFILE	"SMTP.LSE"	/* Name of lease file, in each work
+					   area */
+#define	LEASETIME	600		/* Time after which an unrenewed
+					   lease has lapsed (secs) */
+#define	RENEWTIME	60		/* Interval between renewals of the
+					   leases (secs) */
+#define	JOURNAL		"SMTP.JNL"	/* Name of delivery journal, in each
+					   work area */
+#define	COMMITCOUNT	32		/* Files sent that cause the journal
+					   to be written at once */
+#define	COMMITTIME	1000		/* Longest wait before the journal is
+					   written (msecs) */
+#define	JNLBUFSIZE	4096		/* Size of journal buffer */
+#define	FINDBUFSIZE	4096		/* Size of directory search buffer */
+#define	STACKSIZE	16384		/* Stack size for renewal and
+					   removal threads */
+
+/* Type definitions */
+
+typedef struct _AREA {			/* Work area in one spool directory */
+struct	_AREA	*next;
+PUCHAR		dirname;		/* The spool directory */
+BOOL		fanout;			/* TRUE if fanned out, so that it
+					   also holds files in x\y */
+UCHAR		work[CCHMAXPATH+1];	/* This process's work area there */
+HFILE		hjnl;			/* Delivery journal in work area */
+BOOL		journal;		/* TRUE if journal is open */
+BOOL		written;		/* TRUE if journal has been written
+					   since it was last emptied */
+} AREA, *PAREA;
+
+typedef struct _SENT {			/* File sent, not yet removed */
+struct	_SENT	*next;
+PAREA		area;			/* Work area holding it */
+UCHAR		name[CCHMAXPATH+1];	/* Its name within that, including
+					   any subdirectory */
+} SENT, *PSENT;
+
+/* Forward references */
+
+static	VOID	commit(PSENT);
+static	PAREA	find_area(PUCHAR, PUCHAR *);
+static	BOOL	lapsed(PUCHAR);
+static	BOOL	make_area(PAREA);
+static	VOID	make_dirs(PUCHAR, ULONG);
+static	VOID	move_files(PUCHAR, PUCHAR);
+static	VOID	open_journal(PAREA);
+static	VOID	reaper(PVOID);
+static	VOID	recover(PAREA);
+static	VOID	renew(PAREA);
+static	VOID	renewer(PVOID);
+static	VOID	replay(PUCHAR);
+static	VOID	return_files(PUCHAR, PUCHAR);
+static	BOOL	start_reaper(VOID);
+
+/* Local storage */
+
+static	PAREA	areas;			/* Work areas of this process */
+static	BOOL	every;			/* TRUE if every spool directory has
+					   a work area */
+static	UCHAR	worker[9];		/* Name of this process's work
+					   areas */
+static	BOOL	threaded;		/* TRUE if renewal thread started */
+static	TID	tid;			/* The renewal thread */
+static	HEV	hevstop;		/* Posted when renewal is to stop */
+static	BOOL	reaping;		/* TRUE if removal thread started */
+static	BOOL	stopping;		/* TRUE if removal is to stop */
+static	TID	rtid;			/* The removal thread */
+static	HMTX	hmtx;			/* Serialises access to 'sent' */
+static	HMTX	hmtxjnl;		/* Held while files are removed,
+					   until journals are emptied */
+static	HEV	hevsent;		/* Posted when 'sent' is not empty */
+static	HEV	hevfull;		/* Posted when 'sent' is full, or
+					   removal is to stop */
+static	PSENT	sent;			/* Files sent, not yet in journal */
+static	INT	nsent;			/* Number of entries in 'sent' */
+
+
+/*
+ * Set up a work area for this process in each of the directories in
+ * 'list', returning any files left in it from before, and start the
+ * threads that renew the leases and remove the files sent. A directory
+ * where there can be no work area has its files sent where they are, as
+ * if nothing else were using it. The subdirectories of a fanned out
+ * directory use the work area of the directory itself.
+ *
+ */
+
+VOID claim_start(PFL list)
+{	PFL temp;
+	PAREA ap;
+	PTIB ptib;
+	PPIB ppib;
+	APIRET rc;
+	INT t;
+
+	areas = (PAREA) NULL;
+	every = TRUE;
+	(VOID) DosGetInfoBlocks(&ptib, &ppib);
+	sprintf(worker, "%08lX", ppib->pib_ulpid);
+
+	for(temp = list; temp != (PFL) NULL; temp = temp->next) {
+		if(temp->isdir == FALSE || temp->root != (PFL) NULL) continue;
+
+		ap = (PAREA) xmalloc(sizeof(AREA));
+		if(ap == (PAREA) NULL) {
+			every = FALSE;
+			return;
+		}
+		ap->dirname = temp->name;
+		ap->fanout = temp->fanout;
+		sprintf(ap->work, "%s\\%s\\%s", temp->name, WORKDIR, worker);
+		if(make_area(ap) == FALSE) {
+			error("cannot make work area %s", ap->work);
+			free(ap);
+			every = FALSE;
+			continue;
+		}
+		return_files(ap->work, ap->dirname);
+		open_journal(ap);
+		recover(ap);
+
+		ap->next = areas;
+		areas = ap;
+	}
+
+	threaded = FALSE;
+	reaping = FALSE;
+	if(areas == (PAREA) NULL) return;
+
+	reaping = start_reaper();
+	if(reaping == FALSE)		/* Files are removed at once */
+		error("cannot start file removal thread");
+
+	rc = DosCreateEventSem((PSZ) NULL, &hevstop, 0, FALSE);
+	if(rc != NO_ERROR) return;
+	t = _beginthread(renewer, (PVOID) NULL, STACKSIZE, (PVOID) NULL);
+	if(t != -1) {
+		tid = (TID) t;
+		threaded = TRUE;
+		return;
+	}
+	(VOID) DosCloseEventSem(hevstop);
+
+	error("cannot start lease renewal thread");
+}
+
+
+/*
+ * Start the thread that removes the files sent, with the semaphores it
+ * uses.
+ *
+ * Returns:
+ *	TRUE		thread started
+ *	FALSE		thread could not be started
+ *
+ */
+
+static BOOL start_reaper(VOID)
+{	APIRET rc;
+	INT t;
+
+	sent = (PSENT) NULL;
+	nsent = 0;
+	stopping = FALSE;
+
+	rc = DosCreateMutexSem((PSZ) NULL, &hmtx, 0, FALSE);
+	if(rc != NO_ERROR) return(FALSE);
+	rc = DosCreateMutexSem((PSZ) NULL, &hmtxjnl, 0, FALSE);
+	if(rc == NO_ERROR) {
+		rc = DosCreateEventSem((PSZ) NULL, &hevsent, 0, FALSE);
+		if(rc == NO_ERROR) {
+			rc = DosCreateEventSem((PSZ) NULL, &hevfull, 0, FALSE);
+			if(rc == NO_ERROR) {
+				t = _beginthread(reaper, (PVOID) NULL,
+					STACKSIZE, (PVOID) NULL);
+				if(t != -1) {
+					rtid = (TID) t;
+					return(TRUE);
+				}
+				(VOID) DosCloseEventSem(hevfull);
+			}
+			(VOID) DosCloseEventSem(hevsent);
+		}
+		(VOID) DosCloseMutexSem(hmtxjnl);
+	}
+	(VOID) DosCloseMutexSem(hmtx);
+
+	return(FALSE);
+}
+
+
+/*
+ * Stop renewing the leases, remove the files that have been sent, and
+ * give up all of the work areas, returning any files still in them to
+ * their spool directories. None of the files must still be open.
+ *
+ */
+
+VOID claim_stop(VOID)
+{	PAREA ap;
+	UCHAR name[CCHMAXPATH+1];
+
+	if(threaded == TRUE) {
+		(VOID) DosPostEventSem(hevstop);
+		(VOID) DosWaitThread(&tid, DCWW_WAIT);
+		(VOID) DosCloseEventSem(hevstop);
+		threaded = FALSE;
+	}
+
+	if(reaping == TRUE) {		/* Removes the rest */
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+		stopping = TRUE;
+		(VOID) DosPostEventSem(hevsent);
+		(VOID) DosPostEventSem(hevfull);
+		(VOID) DosReleaseMutexSem(hmtx);
+		(VOID) DosWaitThread(&rtid, DCWW_WAIT);
+		(VOID) DosCloseEventSem(hevfull);
+		(VOID) DosCloseEventSem(hevsent);
+		(VOID) DosCloseMutexSem(hmtxjnl);
+		(VOID) DosCloseMutexSem(hmtx);
+		reaping = FALSE;
+	}
+
+	while(areas != (PAREA) NULL) {
+		ap = areas;
+		areas = ap->next;
+		if(ap->journal == TRUE) (VOID) DosClose(ap->hjnl);
+		return_files(ap->work, ap->dirname);
+		sprintf(name, "%s\\%s", ap->work, JOURNAL);
+		(VOID) DosDelete(name);
+		sprintf(name, "%s\\%s", ap->work, LEASEFILE);
+		(VOID) DosDelete(name);
+		(VOID) DosDeleteDir(ap->work);
+		sprintf(name, "%s\\%s", ap->dirname, WORKDIR);
+		(VOID) DosDeleteDir(name);	/* Unless still in use */
+		free(ap);
+	}
+}
+
+
+/*
+ * Claim the mail file 'name', by moving it into this process's work area,
+ * so that no other process will send it. The name it then has is placed
+ * in 'path'; this can also be got later with 'claim_path'. This waits
+ * while files sent are being removed from the work areas (see 'commit').
+ *
+ * Returns:
+ *	TRUE		file claimed
+ *	FALSE		file has gone (probably claimed by another process)
+ *
+ */
+
+BOOL claim_take(PUCHAR name, PUCHAR path)
+{	PAREA ap;
+	APIRET rc;
+
+	claim_path(name, path);
+	if(strcmp(path, name) == 0) return(TRUE);	/* Not claimed */
+	ap = find_area(name, (PUCHAR *) NULL);
+
+	if(reaping == TRUE)
+		(VOID) DosRequestMutexSem(hmtxjnl, SEM_INDEFINITE_WAIT);
+	rc = DosMove(name, path);
+	if(rc == ERROR_PATH_NOT_FOUND && make_area(ap) == TRUE) {
+		/* Area was recovered, or the file is the first from its
+		   subdirectory */
+
+		make_dirs(path, strlen(ap->work));
+		rc = DosMove(name, path);
+	}
+	if(reaping == TRUE) (VOID) DosReleaseMutexSem(hmtxjnl);
+
+	return(rc == NO_ERROR ? TRUE : FALSE);
+}
+
+
+/*
+ * See whether every mail file found in the spool directories is claimed
+ * before it is sent. If so, a file being sent is never found by a search
+ * of the directories, and so cannot be returned twice.
+ *
+ * Returns:
+ *	TRUE		every file is claimed
+ *	FALSE		some directory has no work area
+ *
+ */
+
+BOOL claim_all(VOID)
+{	return(every);
+}
+
+
+/*
+ * See whether the mail file 'name' is claimed by any copy of the program,
+ * and has not yet been removed; it is then no longer found in its spool
+ * directory, but has not gone.
+ *
+ * Returns:
+ *	TRUE		file is claimed
+ *	FALSE		file is not claimed
+ *
+ */
+
+BOOL claim_held(PUCHAR name)
+{	PAREA ap;
+	PUCHAR base;
+	FILEFINDBUF3 entry;
+	FILESTATUS3 fs;
+	HDIR hdir = HDIR_CREATE;
+	ULONG count = 1;
+	APIRET rc;
+	BOOL held = FALSE;
+	UCHAR path[CCHMAXPATH+3];
+
+	ap = find_area(name, &base);
+	if(ap == (PAREA) NULL) return(FALSE);
+
+	sprintf(path, "%s\\%s\\*", ap->dirname, WORKDIR);
+	rc = DosFindFirst(
+		path,
+		&hdir,
+		MUST_HAVE_DIRECTORY | FILE_DIRECTORY,
+		&entry,
+		sizeof(entry),
+		&count,
+		FIL_STANDARD);
+	if(rc != NO_ERROR) return(FALSE);
+
+	while(held == FALSE && rc == NO_ERROR && count != 0) {
+		if(entry.achName[0] != '.' &&
+		   strlen(ap->dirname) + strlen(WORKDIR) +
+		   strlen(entry.achName) + strlen(base) + 3 <= CCHMAXPATH) {
+			sprintf(path, "%s\\%s\\%s\\%s", ap->dirname, WORKDIR,
+				entry.achName, base);
+			rc = DosQueryPathInfo(path, FIL_STANDARD, &fs,
+					sizeof(fs));
+			if(rc == NO_ERROR) held = TRUE;
+		}
+		count = 1;
+		rc = DosFindNext(hdir, &entry, sizeof(entry), &count);
+	}
+	(VOID) DosFindClose(hdir);
+
+	return(held);
+}
+
+
+/*
+ * Work out the name that the mail file 'name' has while it is claimed,
+ * and place it in 'path'. This is the same as 'name' for a file that is
+ * not claimed.
+ *
+ */
+
+VOID claim_path(PUCHAR name, PUCHAR path)
+{	PAREA ap;
+	PUCHAR base;
+
+	ap = find_area(name, &base);
+	if(ap == (PAREA) NULL ||
+	   strlen(ap->work) + strlen(base) + 1 > CCHMAXPATH) {
+		strcpy(path, name);
+		return;
+	}
+
+	sprintf(path, "%s\\%s", ap->work, base);
+}
+
+
+/*
+ * Remove the claimed mail file 'name', which has been sent. A file in a
+ * work area is only added to the list of files sent; it is removed, once
+ * recorded in the journal, by the removal thread.
+ *
+ */
+
+VOID claim_done(PUCHAR name)
+{	PSENT dp;
+	PAREA ap;
+	PUCHAR base;
+	UCHAR path[CCHMAXPATH+1];
+
+	claim_path(name, path);
+	if(reaping == FALSE || strcmp(path, name) == 0) {
+		remove(path);
+		return;
+	}
+
+	ap = find_area(name, &base);
+	dp = (PSENT) xmalloc(sizeof(SENT));
+	if(dp == (PSENT) NULL || ap->journal == FALSE) {
+		if(dp != (PSENT) NULL) free(dp);
+		remove(path);
+		return;
+	}
+	dp->area = ap;
+	strcpy(dp->name, base);
+
+	(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	dp->next = sent;
+	sent = dp;
+	if(++nsent == 1) (VOID) DosPostEventSem(hevsent);
+	if(nsent == COMMITCOUNT) (VOID) DosPostEventSem(hevfull);
+	(VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Give up the claim on the mail file 'name', by moving it back to its
+ * spool directory, so that it can be tried again. If that fails, the file
+ * is returned when the process stops.
+ *
+ */
+
+VOID claim_release(PUCHAR name)
+{	UCHAR path[CCHMAXPATH+1];
+
+	claim_path(name, path);
+	if(strcmp(path, name) != 0) (VOID) DosMove(path, name);
+}
+
+
+/*
+ * The renewal thread. Each lease is renewed every RENEWTIME, and the other
+ * work areas checked for leases that have lapsed.
+ *
+ */
+
+static VOID renewer(PVOID arg)
+{	PAREA ap;
+
+	while(DosWaitEventSem(hevstop, RENEWTIME*1000) == ERROR_TIMEOUT) {
+		for(ap = areas; ap != (PAREA) NULL; ap = ap->next) {
+			renew(ap);
+			recover(ap);
+		}
+	}
+}
+
+
+/*
+ * The removal thread. It waits for a file to be sent, then for up to
+ * COMMITTIME for more (unless COMMITCOUNT are sent first), then records
+ * all of those files in the journal and removes them.
+ *
+ */
+
+static VOID reaper(PVOID arg)
+{	PSENT list;
+	ULONG posts;
+	BOOL last;
+
+	do {
+		(VOID) DosWaitEventSem(hevsent, SEM_INDEFINITE_WAIT);
+		(VOID) DosWaitEventSem(hevfull, COMMITTIME);
+
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+		list = sent;
+		sent = (PSENT) NULL;
+		nsent = 0;
+		(VOID) DosResetEventSem(hevsent, &posts);
+		(VOID) DosResetEventSem(hevfull, &posts);
+		last = stopping;
+		(VOID) DosReleaseMutexSem(hmtx);
+
+		commit(list);
+	} while(last == FALSE);
+}
+
+
+/*
+ * Record the files on 'list' in the journals of their work areas, wait
+ * for the journals to reach the disk, and then remove the files. Once they
+ * are gone, the journals are emptied again, and this too is waited for.
+ * From the first removal until then, 'hmtxjnl' is held, so that no file
+ * is claimed; otherwise a new file moved into a work area under the name
+ * of one just removed would be taken as sent if the process were to stop
+ * before the emptied journal reached the disk. The entries on the list
+ * are freed.
+ *
+ * If a journal cannot be written, the files are removed anyway, as they
+ * would have been without it.
+ *
+ */
+
+static VOID commit(PSENT list)
+{	PAREA ap;
+	PSENT dp;
+	ULONG done, len, n;
+	UCHAR buf[JNLBUFSIZE];
+	UCHAR name[CCHMAXPATH+1];
+
+	if(list == (PSENT) NULL) return;
+
+	for(ap = areas; ap != (PAREA) NULL; ap = ap->next) {
+		len = 0;
+		for(dp = list; dp != (PSENT) NULL; dp = dp->next) {
+			if(dp->area != ap) continue;
+			n = strlen(dp->name);
+			if(len + n + 2 > JNLBUFSIZE) {
+				(VOID) DosWrite(ap->hjnl, buf, len, &done);
+				len = 0;
+			}
+			memcpy(&buf[len], dp->name, n);
+			len += n;
+			buf[len++] = '\r';
+			buf[len++] = '\n';
+			ap->written = TRUE;
+		}
+		if(len != 0) (VOID) DosWrite(ap->hjnl, buf, len, &done);
+		if(ap->written == TRUE) (VOID) DosResetBuffer(ap->hjnl);
+	}
+
+	(VOID) DosRequestMutexSem(hmtxjnl, SEM_INDEFINITE_WAIT);
+	while(list != (PSENT) NULL) {
+		dp = list;
+		list = dp->next;
+		sprintf(name, "%s\\%s", dp->area->work, dp->name);
+		(VOID) DosDelete(name);
+		free(dp);
+	}
+
+	for(ap = areas; ap != (PAREA) NULL; ap = ap->next) {
+		if(ap->written == FALSE) continue;
+		(VOID) DosSetFileSize(ap->hjnl, 0);
+		(VOID) DosSetFilePtr(ap->hjnl, 0, FILE_BEGIN, &done);
+		(VOID) DosResetBuffer(ap->hjnl);
+		ap->written = FALSE;
+	}
+	(VOID) DosReleaseMutexSem(hmtxjnl);
+}
+
+
+/*
+ * Find the work area for the mail file 'name'; a pointer to the name of
+ * the file within its directory (including any subdirectory, if it is
+ * fanned out) is returned via 'basep', if that is not NULL.
+ *
+ * Returns:
+ *	pointer to the work area
+ *	NULL if the file is not in a spool directory with one
+ *
+ */
+
+static PAREA find_area(PUCHAR name, PUCHAR *basep)
+{	PAREA ap;
+	ULONG len;
+
+	for(ap = areas; ap != (PAREA) NULL; ap = ap->next) {
+		len = strlen(ap->dirname);
+		if(strncmp(ap->dirname, name, len) != 0 ||
+		   name[len] != '\\') continue;
+		if(ap->fanout == FALSE && strchr(&name[len+1], '\\') != NULL)
+			continue;
+		if(basep != (PUCHAR *) NULL) *basep = &name[len+1];
+		return(ap);
+	}
+
+	return((PAREA) NULL);
+}
+
+
+/*
+ * Make the work area 'ap', if it does not exist, and give it a lease.
+ *
+ * Returns:
+ *	TRUE		work area ready
+ *	FALSE		work area could not be made
+ *
+ */
+
+static BOOL make_area(PAREA ap)
+{	UCHAR name[CCHMAXPATH+1];
+	APIRET rc;
+
+	sprintf(name, "%s\\%s", ap->dirname, WORKDIR);
+	(VOID) DosCreateDir(name, (PEAOP2) NULL);	/* May exist already */
+	rc = DosCreateDir(ap->work, (PEAOP2) NULL);
+	if(rc != NO_ERROR && rc != ERROR_ACCESS_DENIED) return(FALSE);
+
+	renew(ap);
+
+	return(TRUE);
+}
+
+
+/*
+ * Make the subdirectories that the path 'path' needs, below its first
+ * 'len' characters (which name a directory that exists already).
+ *
+ */
+
+static VOID make_dirs(PUCHAR path, ULONG len)
+{	PUCHAR p;
+
+	for(p = strchr(&path[len+1], '\\'); p != (PUCHAR) NULL;
+	    p = strchr(p+1, '\\')) {
+		*p = '\0';
+		(VOID) DosCreateDir(path, (PEAOP2) NULL);	/* May exist */
+		*p = '\\';
+	}
+}
+
+
+/*
+ * Renew the lease on the work area 'ap', by writing the current time to
+ * its lease file.
+ *
+ */
+
+static VOID renew(PAREA ap)
+{	UCHAR name[CCHMAXPATH+1];
+	HFILE hf;
+	APIRET rc;
+	ULONG action, done, now;
+
+	sprintf(name, "%s\\%s", ap->work, LEASEFILE);
+	rc = DosOpen(
+		name,
+		&hf,
+		&action,
+		0,
+		FILE_HIDDEN,
+		OPEN_ACTION_CREATE_IF_NEW | OPEN_ACTION_REPLACE_IF_EXISTS,
+		OPEN_FLAGS_NOINHERIT | OPEN_SHARE_DENYWRITE |
+			OPEN_ACCESS_WRITEONLY,
+		(PEAOP2) NULL);
+	if(rc != NO_ERROR) return;
+
+	now = (ULONG) time((time_t *) NULL);
+	(VOID) DosWrite(hf, &now, sizeof(now), &done);
+	(VOID) DosClose(hf);
+}
+
+
+/*
+ * Open a new, empty, journal in the work area 'ap'. Any journal left from
+ * before must already have been replayed (see 'replay'). If the journal
+ * cannot be opened, files sent from the work area are removed at once.
+ *
+ */
+
+static VOID open_journal(PAREA ap)
+{	UCHAR name[CCHMAXPATH+1];
+	APIRET rc;
+	ULONG action;
+
+	ap->journal = FALSE;
+	ap->written = FALSE;
+	sprintf(name, "%s\\%s", ap->work, JOURNAL);
+	rc = DosOpen(
+		name,
+		&ap->hjnl,
+		&action,
+		0,
+		FILE_HIDDEN,
+		OPEN_ACTION_CREATE_IF_NEW | OPEN_ACTION_REPLACE_IF_EXISTS,
+		OPEN_FLAGS_NOINHERIT | OPEN_SHARE_DENYWRITE |
+			OPEN_ACCESS_WRITEONLY,
+		(PEAOP2) NULL);
+	if(rc != NO_ERROR) return;
+
+	(VOID) DosResetBuffer(ap->hjnl);	/* Old entries now gone */
+	ap->journal = TRUE;
+}
+
+
+/*
+ * Look for the work areas of other processes in the same spool directory
+ * as the work area 'ap', and return the files in any whose lease has
+ * lapsed to the spool directory, removing the work area.
+ *
+ */
+
+static VOID recover(PAREA ap)
+{	FILEFINDBUF3 entry;
+	HDIR hdir = HDIR_CREATE;
+	ULONG count = 1;
+	APIRET rc;
+	UCHAR name[CCHMAXPATH+3];
+	UCHAR work[CCHMAXPATH+1];
+
+	sprintf(name, "%s\\%s\\*", ap->dirname, WORKDIR);
+	rc = DosFindFirst(
+		name,
+		&hdir,
+		MUST_HAVE_DIRECTORY | FILE_DIRECTORY,
+		&entry,
+		sizeof(entry),
+		&count,
+		FIL_STANDARD);
+	if(rc != NO_ERROR) return;
+
+	while(rc == NO_ERROR && count != 0) {
+		if(entry.achName[0] != '.' &&
+		   strcmp(entry.achName, worker) != 0) {
+			sprintf(work, "%s\\%s\\%s", ap->dirname, WORKDIR,
+				entry.achName);
+			if(lapsed(work) == TRUE) {
+				return_files(work, ap->dirname);
+				sprintf(name, "%s\\%s", work, JOURNAL);
+				(VOID) DosDelete(name);
+				sprintf(name, "%s\\%s", work, LEASEFILE);
+				(VOID) DosDelete(name);
+				(VOID) DosDeleteDir(work);
+			}
+		}
+		count = 1;
+		rc = DosFindNext(hdir, &entry, sizeof(entry), &count);
+	}
+	(VOID) DosFindClose(hdir);
+}
+
+
+/*
+ * See whether the lease on the work area 'work' has lapsed. A work area
+ * whose lease cannot be read is left alone; it may be just starting.
+ *
+ * Returns:
+ *	TRUE		lease has lapsed
+ *	FALSE		lease is current, or cannot be read
+ *
+ */
+
+static BOOL lapsed(PUCHAR work)
+{	UCHAR name[CCHMAXPATH+1];
+	HFILE hf;
+	APIRET rc;
+	ULONG action, got, stamp;
+
+	sprintf(name, "%s\\%s", work, LEASEFILE);
+	rc = DosOpen(
+		name,
+		&hf,
+		&action,
+		0,
+		FILE_NORMAL,
+		OPEN_ACTION_FAIL_IF_NEW | OPEN_ACTION_OPEN_IF_EXISTS,
+		OPEN_FLAGS_NOINHERIT | OPEN_SHARE_DENYNONE |
+			OPEN_ACCESS_READONLY,
+		(PEAOP2) NULL);
+	if(rc != NO_ERROR) return(FALSE);
+	rc = DosRead(hf, &stamp, sizeof(stamp), &got);
+	(VOID) DosClose(hf);
+	if(rc != NO_ERROR || got != sizeof(stamp)) return(FALSE);
+
+	return((ULONG) time((time_t *) NULL) - stamp > LEASETIME ?
+		TRUE : FALSE);
+}
+
+
+/*
+ * Move all of the mail files in the work area 'work' back to the spool
+ * directory 'dirname', except those that the journal there shows have
+ * been sent; those are removed. The lease file and the journal are
+ * hidden, so they stay where they are.
+ *
+ */
+
+static VOID return_files(PUCHAR work, PUCHAR dirname)
+{	replay(work);
+	move_files(work, dirname);
+}
+
+
+/*
+ * Move all of the files in the directory 'from' to the directory 'to'.
+ * The files in each subdirectory of 'from' (from a fanned out directory)
+ * go to the subdirectory of the same name in 'to', and the subdirectory
+ * is then removed.
+ *
+ */
+
+static VOID move_files(PUCHAR from, PUCHAR to)
+{	FILEFINDBUF3 entry;
+	HDIR hdir = HDIR_CREATE;
+	ULONG count = 1;
+	APIRET rc;
+	UCHAR mask[CCHMAXPATH+3];
+	UCHAR src[CCHMAXPATH+1];
+	UCHAR dst[CCHMAXPATH+1];
+
+	sprintf(mask, "%s\\*", from);
+	rc = DosFindFirst(
+		mask,
+		&hdir,
+		FILE_NORMAL | FILE_DIRECTORY,
+		&entry,
+		sizeof(entry),
+		&count,
+		FIL_STANDARD);
+	if(rc != NO_ERROR) return;
+
+	while(rc == NO_ERROR && count != 0) {
+		if(entry.achName[0] != '.' &&
+		   strlen(from) + strlen(entry.achName) < CCHMAXPATH &&
+		   strlen(to) + strlen(entry.achName) < CCHMAXPATH) {
+			sprintf(src, "%s\\%s", from, entry.achName);
+			sprintf(dst, "%s\\%s", to, entry.achName);
+			if(entry.attrFile & FILE_DIRECTORY) {
+				move_files(src, dst);
+				(VOID) DosDeleteDir(src);
+			} else (VOID) DosMove(src, dst);
+		}
+		count = 1;
+		rc = DosFindNext(hdir, &entry, sizeof(entry), &count);
+	}
+	(VOID) DosFindClose(hdir);
+}
+
+
+/*
+ * Remove the mail files named in the journal in the work area 'work',
+ * which have been sent. Each entry is a name ending in CR LF; an entry
+ * left incomplete when the process stopped is ignored, since the file it
+ * names cannot have been removed.
+ *
+ */
+
+static VOID replay(PUCHAR work)
+{	HFILE hf;
+	APIRET rc;
+	ULONG action, got, i;
+	INT len = 0;
+	UCHAR buf[JNLBUFSIZE];
+	UCHAR base[CCHMAXPATH+1];
+	UCHAR name[2*CCHMAXPATH+2];
+
+	sprintf(name, "%s\\%s", work, JOURNAL);
+	rc = DosOpen(
+		name,
+		&hf,
+		&action,
+		0,
+		FILE_NORMAL,
+		OPEN_ACTION_FAIL_IF_NEW | OPEN_ACTION_OPEN_IF_EXISTS,
+		OPEN_FLAGS_NOINHERIT | OPEN_SHARE_DENYWRITE |
+			OPEN_ACCESS_READONLY,
+		(PEAOP2) NULL);
+	if(rc != NO_ERROR) return;
+
+	for(;;) {
+		rc = DosRead(hf, buf, JNLBUFSIZE, &got);
+		if(rc != NO_ERROR || got == 0) break;
+		for(i = 0; i < got; i++) {
+			if(buf[i] != '\n') {
+				if(len < CCHMAXPATH) base[len++] = buf[i];
+				continue;
+			}
+			if(len > 1 && base[len-1] == '\r') {
+				base[len-1] = '\0';
+				sprintf(name, "%s\\%s", work, base);
+				(VOID) DosDelete(name);
+			}
+			len = 0;
+		}
+	}
+	(VOID) DosClose(hf);
+}
+
+/*
+ * End of file: claim.c
+ *
+ */
+
+
\ No newline at end of file
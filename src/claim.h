@@ -0,0 +1,27 @@
+/*
+ * File: claim.h
+ *
+ * Claiming of mail files, so that several copies of the program can share
+ * the same spool directories; header file.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+/* External references */
+
+extern	BOOL	claim_all(VOID);
+extern	VOID	claim_done(PUCHAR);
+extern	BOOL	claim_held(PUCHAR);
+extern	VOID	claim_path(PUCHAR, PUCHAR);
+extern	VOID	claim_release(PUCHAR);
+extern	VOID	claim_start(PFL);
+extern	VOID	claim_stop(VOID);
+extern	BOOL	claim_take(PUCHAR, PUCHAR);
+
+/*
+ * End of file: claim.h
+ *
+ */
+
+
\ No newline at end of file
@@ -9,6 +9,21 @@
  *
  */
 
+/*
+ * The conversation with the server is driven by events from the engine
+ * (see engine.c); nothing here ever waits. Each session is an explicit
+ * state machine: the phase says what the last command sent was, so that
+ * each reply, when it arrives, can be acted upon and the next command
+ * sent. While message text is being sent, the session is driven by the
+ * socket becoming writable instead.
+ *
+ * When running as a daemon, a session with nothing to send stays open,
+ * and checks every so often for new mail; NOOP is sent now and then to
+ * keep the connection alive. After a long enough idle time, the session is
+ * closed; the caller makes new connections when there is more mail.
+ *
+ */
+
 #pragma	strings(readonly)
 
 #include <stdio.h>
@@ -16,7 +31,6 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
-#include <io.h>
 
 #define	INCL_DOSERRORS
 #define	INCL_DOSFILEMGR
@@ -24,16 +38,40 @@
 
 #include "smtp.h"
 #include "netio.h"
+#include "engine.h"
 #include "auth.h"
+#include "spool.h"
+#include "prefetch.h"
+#include "qindex.h"
+#include "claim.h"
+#ifdef	TLS
+#include "tls.h"
+#endif
 
+#define	NETBUFSIZE	16384		/* Size of network input buffer */
 #define	RBUFSIZE	1000		/* Size of read buffer */
 #define	WBUFSIZE	1000		/* Size of write buffer */
 #define	RTIMEOUT	30		/* Read timeout (secs) */
 #define	WTIMEOUT	30		/* Write timeout (secs) */
 
-#define	MAXLINE		2002		/* Maximum length of line */
 #define	MAXMES		100		/* Maximum message length */
+#define	MAXNUM		20		/* Longest number, in decimal, that
+					   may be added to a message */
 #define	MAXAUTH		10		/* Maximum number of auth types */
+#define	MAXPIPE		100		/* Maximum commands awaiting reply,
+					   when pipelining */
+#define	CHUNKMIN	16384		/* Size of first BDAT chunk of each
+					   message */
+#define	KEEPALIVE	60		/* Interval between NOOPs, when idle
+					   (secs) */
+#define	IDLELIMIT	600		/* Idle time after which session is
+					   closed (secs) */
+#define	IDLETICK	50		/* Interval between checks for new
+					   mail, when idle (ms) */
+#define	DEADDIR		"DEAD"		/* Directory for mail refused for
+					   good, below its spool directory */
+#define	REPLYEXT	".RPY"		/* Added to the name of such a file,
+					   for the file holding the reply */
 
 /* Type definitions */
 
@@ -41,31 +79,143 @@ typedef	enum	{ ST_MAIL, ST_RCPT, ST_RCPT_OR_DATA, ST_DATA,
 		  ST_DATASTART, ST_TEXT }
 	STATE;
 
+typedef	enum	{ PH_GREETING, PH_EHLO, PH_HELO, PH_STARTTLS, PH_HANDSHAKE,
+		  PH_AUTH, PH_ETRN, PH_ENVELOPE, PH_TEXT, PH_CHUNK, PH_BDAT,
+		  PH_DOT, PH_RSET, PH_IDLE, PH_NOOP, PH_QUIT }
+	PHASE;				/* Phase of SMTP conversation */
+
+typedef	enum	{ OUT_SENT, OUT_DEFERRED, OUT_REJECTED, OUT_FAILED }
+	OUTCOME;			/* Result of trying to send message */
+
+typedef struct _WORK {			/* Totals for all sessions */
+BOOL		watch;			/* TRUE if running as a daemon */
+INT		sessions;		/* Number of sessions */
+INT		quiet;			/* Sessions finished, or idle with
+					   nothing in progress */
+INT		started;		/* Messages started, all sessions */
+INT		msgcount;		/* Messages sent, all sessions */
+INT		deferred;		/* Messages deferred, all sessions */
+INT		unsent;			/* Messages not sent, all sessions */
+} WORK, *PWORK;
+
+typedef struct _SESSION {		/* State of one SMTP session */
+CONN		conn;			/* Connection, as seen by engine */
+PNETIO		net;			/* Network connection */
+PWORK		work;			/* Where to find files to send */
+PHASE		phase;			/* Phase of the conversation */
+INT		step;			/* Step within AUTH phase */
+INT		rlines;			/* Lines so far of current reply */
+BOOL		ok;			/* TRUE if session ended properly */
+BOOL		quiet;			/* TRUE if counted in 'quiet' total */
+ULONG		idlestart;		/* Time session last became idle */
+ULONG		lastnoop;		/* Time last NOOP sent, when idle */
+PUCHAR		clientname;		/* Our name, for EHLO/HELO */
+PUCHAR		username;		/* Username for authentication */
+PUCHAR		password;		/* Password for authentication */
+PUCHAR		domain;			/* Domain for ETRN, or empty */
+INT		authmech;		/* Auth mechanism chosen for use */
+BOOL		extensions;		/* True if EHLO accepted */
+BOOL		verbose;		/* True to display progress */
+BOOL		etrn_ok;		/* True if ETRN accepted */
+BOOL		pipelining;		/* True if server allows PIPELINING */
+BOOL		chunking;		/* True if server allows CHUNKING */
+BOOL		sizeext;		/* True if server allows SIZE */
+INT		tlsmode;		/* Use of STARTTLS (TLS_xxx) */
+BOOL		starttls;		/* True if server allows STARTTLS */
+BOOL		secure;			/* True once TLS is in use */
+ULONG		tlsstart;		/* Time TLS handshake started */
+BOOL		readwrite;		/* TRUE if TLS must write before it
+					   can read any more */
+INT		msgcount;		/* Messages sent in this session */
+INT		deferred;		/* Messages deferred (temporary
+					   failure) in this session */
+INT		unsent;			/* Messages not sent for any other
+					   reason in this session */
+PSPOOL		spool;			/* Mail file being sent, or NULL */
+UCHAR		fname[CCHMAXPATH+1];	/* Name of that file */
+UCHAR		sender[QADDRLEN];	/* Its sender, for the queue index */
+INT		rcpts;			/* Its recipients, so far */
+STATE		state;			/* Position in mail file */
+STATE		sent;			/* Last envelope command sent */
+INT		outstanding;		/* Envelope commands awaiting reply */
+INT		replies;		/* Envelope replies received so far */
+BOOL		failed;			/* TRUE if envelope has failed */
+UCHAR		freply[RBUFSIZE+1];	/* First failure reply, if any */
+BOOL		dotwait;		/* TRUE if awaiting reply to end of
+					   text */
+BOOL		rsetwait;		/* TRUE if awaiting reply to RSET */
+UCHAR		dname[CCHMAXPATH+1];	/* File whose text that was */
+INT		line;			/* Line number in mail file */
+INT		chunkmax;		/* Maximum size of BDAT chunk */
+INT		csize;			/* Size for next BDAT chunk */
+PUCHAR		chunk;			/* BDAT chunk being sent */
+INT		clen;			/* Length of that chunk */
+INT		coff;			/* Offset of next byte to send */
+BOOL		clast;			/* TRUE if it is the last chunk */
+INT		chunks;			/* BDAT commands awaiting reply */
+BOOL		rejected;		/* TRUE if text has been refused */
+UCHAR		rbuf[RBUFSIZE+1];	/* Last reply from server */
+UCHAR		wbuf[WBUFSIZE+1];	/* Command being sent to server */
+} SESSION, *PSESSION;
+
 /* Forward references */
 
+static	VOID	auth_reply(PSESSION);
+static	VOID	chunk_reply(PSESSION);
 static	PUCHAR	cmdname(STATE);
-static	BOOL	directory_not_empty(PUCHAR);
-static	BOOL	do_auth_login(INT, PUCHAR, PUCHAR);
-static	BOOL	do_auth_plain(INT, PUCHAR, PUCHAR);
-static	BOOL	do_etrn(INT, PUCHAR, BOOL);
+static	BOOL	dead_letter(PUCHAR, PUCHAR, PUCHAR);
+static	VOID	dot_reply(PSESSION);
 static	PUCHAR	enbase64(PUCHAR, INT, PUCHAR);
-static	BOOL	get_reply(INT, PUCHAR);
-static	BOOL	process_directory(INT, PUCHAR, BOOL);
-static	BOOL	process_extensions(INT);
-static	VOID	process_extension_auth(PUCHAR);
-static	BOOL	process_file(INT, PUCHAR, BOOL);
-
-/* Local storage */
+static	VOID	ehlo_line(PSESSION, PUCHAR);
+static	VOID	ehlo_reply(PSESSION);
+static	VOID	envelope_reply(PSESSION);
+static	VOID	etrn_reply(PSESSION);
+static	BOOL	fill_chunk(PSESSION);
+static	VOID	finish(PSESSION, BOOL);
+#ifdef	TLS
+static	BOOL	handshake(PSESSION);
+#endif
+static	VOID	idle_reply(PSESSION);
+static	VOID	idle_timer(PSESSION);
+static	VOID	log_session(PSESSION);
+static	VOID	next_message(PSESSION);
+static	VOID	noop_reply(PSESSION);
+static	VOID	note_sender(PSESSION, PUCHAR);
+static	VOID	outcome(PSESSION, PUCHAR, OUTCOME, PUCHAR);
+static	VOID	process_extension_auth(PSESSION, PUCHAR);
+static	BOOL	process_file(PSESSION, PUCHAR, PSPOOL);
+static	VOID	quit_reply(PSESSION);
+static	VOID	read_error(PSESSION);
+static	OUTCOME	refusal(PUCHAR);
+static	VOID	reset_message(PSESSION);
+static	VOID	rset_reply(PSESSION);
+static	VOID	send_command(PSESSION);
+static	BOOL	send_batch(PSESSION);
+static	VOID	send_chunk(PSESSION);
+static	BOOL	send_envelope(PSESSION);
+static	VOID	send_text(PSESSION);
+static	VOID	session_event(PCONN, INT);
+static	VOID	session_reply(PSESSION);
+static	VOID	set_quiet(PSESSION);
+static	VOID	start_auth(PSESSION);
+static	BOOL	start_chunk(PSESSION);
+static	VOID	start_idle(PSESSION);
+static	VOID	start_tls(PSESSION);
+static	VOID	start_work(PSESSION);
+static	VOID	summary(PUCHAR, INT, INT, INT);
+static	VOID	tls_reply(PSESSION);
 
-static	INT	authmech;		/* Auth mechanism chosen for use */
-static	INT	authsupp;		/* Bitmap of supported auth types */
-static	BOOL	extensions;		/* True if EHLO accepted */
-static	INT	msgcount;
-static	UCHAR	rbuf[RBUFSIZE+1];
-static	UCHAR	wbuf[WBUFSIZE+1];
 
 /*
- * Do the conversation between the client and the server.
+ * Do the conversation between the client and the server, over each of the
+ * 'nsocks' connections in 'socks'. The connections share the work; each
+ * one takes the next file to be sent whenever it is free, so a file is
+ * only ever sent (and removed) by one of them. The files are found, opened
+ * and read ahead of need (see prefetch.c); the read-ahead must already
+ * have been started, unless this is the ETRN case. If 'watch' is TRUE,
+ * the sessions wait for more mail when there is none, rather than ending.
+ * The number of messages sent, deferred and not sent is returned via
+ * 'res', with whether any session as a whole failed.
  *
  * Returns:
  *	TRUE		client ran and terminated
@@ -73,216 +223,414 @@ static	UCHAR	wbuf[WBUFSIZE+1];
  *
  */
 
-BOOL client(INT sockno, PFL filelist, PUCHAR clientname, BOOL verbose,
-		PUCHAR username, PUCHAR password, PUCHAR domain)
-{	BOOL rc;
-	BOOL etrn_rc;
-	PFL temp;
-
-	extensions = FALSE;
-	authmech = AUTH_NONE;		/* No authorisation by default */
+BOOL client(PINT socks, INT nsocks, PUCHAR clientname, BOOL verbose,
+		PUCHAR username, PUCHAR password, PUCHAR domain, INT chunkmax,
+		INT tlsmode, BOOL watch, PRESULT res)
+{	INT i, n;
+	BOOL rc;
+	PSESSION sp;
+	PSESSION sessions[MAXCONN];
+	PCONN conns[MAXCONN];
+	WORK work;
+	UCHAR mes[MAXMES+4*MAXNUM+1];	/* Text, and up to four numbers */
+
+	work.watch = watch;
+	work.sessions = nsocks;
+	work.quiet = 0;
+	work.started = 0;
+	work.msgcount = 0;
+	work.deferred = 0;
+	work.unsent = 0;
+
+	for(n = 0; n < nsocks; n++) {
+		sp = (PSESSION) xmalloc(sizeof(SESSION));
+		if(sp == (PSESSION) NULL) break;
+		memset(sp, 0, sizeof(SESSION));
+
+		sp->net = netio_open(socks[n], NETBUFSIZE);
+		if(sp->net == (PNETIO) NULL) {
+			error("network initialisation failure");
+			free(sp);
+			break;
+		}
 
-	if(netio_init() == FALSE) {
-		error("network initialisation failure");
-		return(FALSE);
+		sp->work = &work;
+		sp->clientname = clientname;
+		sp->username = username;
+		sp->password = password;
+		sp->domain = domain;
+		sp->verbose = verbose;
+		sp->chunkmax = chunkmax;
+		sp->tlsmode = tlsmode;
+		sp->chunk = (PUCHAR) NULL;	/* Allocated when needed */
+		sp->extensions = FALSE;
+		sp->authmech = AUTH_NONE; /* No authorisation by default */
+		sp->phase = PH_GREETING;  /* Server speaks first */
+		sp->spool = (PSPOOL) NULL;
+
+		sp->conn.sockno = socks[n];
+		sp->conn.events = EV_READ;
+		sp->conn.deadline = engine_now() + RTIMEOUT*1000;
+		sp->conn.handler = session_event;
+		sp->conn.data = (PVOID) sp;
+
+		sessions[n] = sp;
+		conns[n] = &sp->conn;
 	}
 
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
+	rc = n == nsocks ? engine_run(conns, n) : FALSE;
 
-	msgcount = 0;
+	for(i = 0; i < n; i++) {
+		if(sessions[i]->ok == FALSE) rc = FALSE;
+		netio_close(sessions[i]->net);
+		if(sessions[i]->chunk != (PUCHAR) NULL)
+			free(sessions[i]->chunk);
+		free(sessions[i]);
+	}
+	res->failed = rc == FALSE ? TRUE : FALSE;
 
-	/* Handle the reply to the connect; first, absorb all but the
-	   last line of any multiline reply */
+	/* Summarise the work done by all of the sessions. Any message that
+	   could not be sent counts as a failure. */
 
-	while(rbuf[3] == '-') {
-		rc = get_reply(sockno, rbuf);
-		if(rc == FALSE) return(FALSE);
+	if(domain[0] == '\0') {		/* Not ETRN case */
+		if(verbose == TRUE) {
+			fprintf(
+				stdout,
+				"%50s\r%d message%s transmitted\n",
+				"",
+				work.msgcount,
+				work.msgcount == 1 ? "" : "s");
+			if(work.deferred + work.unsent != 0)
+				fprintf(
+					stdout,
+					"%d message%s not transmitted\n",
+					work.deferred + work.unsent,
+					work.deferred + work.unsent == 1 ?
+						"" : "s");
+			fflush(stdout);
+		}
+		if(nsocks > 1) {
+			summary(mes, work.msgcount, work.deferred,
+				work.unsent);
+			sprintf(&mes[strlen(mes)-1], " in total, over %d"
+				" connections]", nsocks);
+			dolog(LOG_INFO, mes);
+		}
+		if(work.deferred + work.unsent != 0) rc = FALSE;
 	}
+	res->msgcount = work.msgcount;
+	res->deferred = work.deferred;
+	res->unsent = work.unsent;
 
-	if(rbuf[0] != '2') {		/* Some kind of failure */
-		error("connect failed: %s", rbuf);
-		dolog(LOG_ERR, rbuf);
-		return(FALSE);
+	return(rc);
+}
+
+
+/*
+ * Handle events on a session's connection. Replies from the server are
+ * acted upon as each complete one arrives; the output buffer is then
+ * sent, as far as possible, and the session's interest in further events
+ * and its deadline are updated.
+ *
+ */
+
+static VOID session_event(PCONN cp, INT events)
+{	PSESSION sp = (PSESSION) cp->data;
+	INT rc;
+	PUCHAR line;
+
+	if(events & EV_TIMEOUT) {
+		if(sp->phase == PH_IDLE) {
+			idle_timer(sp);
+			if(sp->conn.sockno == -1) return;
+		} else {
+			error(sock_pending(sp->net) != 0 ||
+				sp->phase == PH_TEXT ||
+				sp->phase == PH_CHUNK ?
+				"network write timeout" :
+				"network read timeout");
+			finish(sp, FALSE);
+			return;
+		}
 	}
 
-	/* Try EHLO to open conversation */
+#ifdef	TLS
+	if(sp->phase == PH_HANDSHAKE && handshake(sp) == FALSE) return;
+#endif
+
+	if(events & EV_READ ||
+	   (sp->readwrite == TRUE && events & EV_WRITE)) {
+		rc = sock_read(sp->net);
+		sp->readwrite = rc == SOCKIO_WANTWRITE ? TRUE : FALSE;
+		if(rc == SOCKIO_ERR) {
+			if(sp->quiet == TRUE) {	/* Dropped while idle */
+				dolog(LOG_INFO, "connection closed by server");
+				log_session(sp);
+				finish(sp, TRUE);
+				return;
+			}
+			error("network read error");
+			finish(sp, FALSE);
+			return;
+		}
 
-	sprintf(wbuf, "EHLO %s\n", clientname);
+		for(;;) {
+			rc = sock_getline(sp->net, &line);
+			if(rc == SOCKIO_AGAIN) break;
+			if(rc == SOCKIO_TOOLONG || rc >= RBUFSIZE - 1) {
+				error("network input line too long");
+				finish(sp, FALSE);
+				return;
+			}
 #ifdef	DEBUG
-	trace(wbuf);
+			trace("%s", line);
 #endif
-	sock_puts(wbuf, sockno, WTIMEOUT);
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
 
-	/* Handle the reply to EHLO.
-	   250 => EHLO recognised and implemented, so process reply
-	   500 => EHLO not recognised, so try HELO
-	   502 => EHLO recognised but not implemented, so try HELO
-	*/
+			/* All but the last line of a multiline reply are
+			   only of interest in reply to EHLO, where they list
+			   the extensions; they are examined in place. */
 
-	rc = (rbuf[0] - '0')*100 + (rbuf[1] - '0')*10 + (rbuf[2] - '0');
+			if(line[3] == '-') {
+				if(sp->phase == PH_EHLO && sp->rlines != 0)
+					ehlo_line(sp, line);
+				sp->rlines++;
+				if(sp->conn.sockno == -1) return;
+				continue;
+			}
 
-	switch(rc) {
-		case 500:
-		case 502:		/* OK, try HELO */
-			sprintf(wbuf, "HELO %s\n", clientname);
-#ifdef	DEBUG
-			trace(wbuf);
+			memcpy(sp->rbuf, line, rc+1);
+			session_reply(sp);
+			sp->rlines = 0;
+			if(sp->conn.sockno == -1) return;
+		}
+	}
+
+#ifdef	TLS
+	if(sp->phase == PH_HANDSHAKE && handshake(sp) == FALSE) return;
 #endif
-			sock_puts(wbuf, sockno, WTIMEOUT);
-			rc = get_reply(sockno, rbuf);
-			if(rc == FALSE) return(FALSE);
-			if(rbuf[0] != '2') {	/* Some kind of failure */
-				error("HELO failed: %s", rbuf);
-				dolog(LOG_ERR, rbuf);
-				return(FALSE);
+
+	if(sp->phase == PH_TEXT) send_text(sp);
+	else if(sp->phase == PH_CHUNK) send_chunk(sp);
+	if(sp->conn.sockno == -1) return;
+
+	rc = sock_flush(sp->net);
+	if(rc == SOCKIO_ERR) {
+		error("network write error");
+		finish(sp, FALSE);
+		return;
+	}
+
+	/* Always listen for replies; write when there is output waiting,
+	   or more message text to be produced, or when TLS must write
+	   before it can read the replies. */
+
+	if(rc == SOCKIO_AGAIN || sp->phase == PH_TEXT ||
+	   sp->phase == PH_CHUNK || sp->readwrite == TRUE) {
+		sp->conn.events = EV_READ | EV_WRITE;
+		sp->conn.deadline = engine_now() + WTIMEOUT*1000;
+	} else {
+		sp->conn.events = EV_READ;
+		sp->conn.deadline = engine_now() +
+			(sp->phase == PH_IDLE ? IDLETICK : RTIMEOUT*1000);
+	}
+
+	set_quiet(sp);
+}
+
+
+/*
+ * Act on a complete reply from the server (the last line of which is in
+ * 'rbuf'), according to the phase of the conversation.
+ *
+ */
+
+static VOID session_reply(PSESSION sp)
+{	/* When pipelining, the next message's envelope (or QUIT) may already
+	   have been sent behind the end of a message's text; the reply to
+	   the end of the text comes first, preceded by those to any earlier
+	   BDAT chunks. */
+
+	if(sp->dotwait == TRUE) {
+		if(sp->chunks > 1)
+			chunk_reply(sp);
+		else
+			dot_reply(sp);
+		return;
+	}
+
+	/* Similarly, the next message may have been started behind an RSET */
+
+	if(sp->rsetwait == TRUE) {
+		rset_reply(sp);
+		return;
+	}
+
+	switch(sp->phase) {
+		case PH_GREETING:
+			if(sp->rbuf[0] != '2') {	/* Some kind of failure */
+				error("connect failed: %s", sp->rbuf);
+				dolog(LOG_ERR, sp->rbuf);
+				finish(sp, FALSE);
+				break;
 			}
-			break;
 
-		case 250:
-			if(rbuf[3] != '-') break;	/* No extensions */
-			extensions = TRUE;
-			if(process_extensions(sockno) == FALSE)
-				return(FALSE);
+			/* Try EHLO to open conversation */
+
+			sprintf(sp->wbuf, "EHLO %s\n", sp->clientname);
+			send_command(sp);
+			sp->phase = PH_EHLO;
 			break;
 
-		default:
-			error("EHLO failed: %s", rbuf);
-			dolog(LOG_ERR, rbuf);
-			return(FALSE);
-	}
+		case PH_EHLO:
+			ehlo_reply(sp);
+			break;
 
-	/* We are now talking to the server. See if authorisation is needed. */
+		case PH_HELO:
+			if(sp->rbuf[0] != '2') {	/* Some kind of failure */
+				error("HELO failed: %s", sp->rbuf);
+				dolog(LOG_ERR, sp->rbuf);
+				finish(sp, FALSE);
+				break;
+			}
+			start_tls(sp);
+			break;
 
-	if(username[0] == '\0') authmech = AUTH_NONE;
+		case PH_STARTTLS:
+			tls_reply(sp);
+			break;
 
-	switch(authmech) {
-		case AUTH_NONE:
+		case PH_HANDSHAKE:		/* No reply expected */
+			error("unexpected reply: %s", sp->rbuf);
+			dolog(LOG_ERR, sp->rbuf);
+			finish(sp, FALSE);
 			break;
 
-		case AUTH_LOGIN:
-			rc = do_auth_login(sockno, username, password);
-			if(rc == FALSE) return(FALSE);
+		case PH_AUTH:
+			auth_reply(sp);
 			break;
 
-		case AUTH_PLAIN:
-			rc = do_auth_plain(sockno, username, password);
-			if(rc == FALSE) return(FALSE);
+		case PH_ETRN:
+			etrn_reply(sp);
 			break;
 
-		default:
-			error("internal error (bad authmech");
-			return(FALSE);
-	}
+		case PH_ENVELOPE:
+			envelope_reply(sp);
+			break;
 
-	if(domain[0] != '\0') {
-		etrn_rc = do_etrn(sockno, domain, verbose);
-	} else {
-		while(filelist != (PFL) NULL) {
-			if(filelist->isdir == TRUE) {
-				process_directory(
-					sockno, filelist->name, verbose);
-			} else {
-				process_file(
-					sockno, filelist->name, verbose);
-			}
-			temp = filelist->next;
-			free(filelist);
-			filelist = temp;
-		}
+		case PH_TEXT:			/* No reply expected yet */
+			error("unexpected reply: %s", sp->rbuf);
+			dolog(LOG_ERR, sp->rbuf);
+			finish(sp, FALSE);
+			break;
 
-		if(verbose == TRUE) {
-			fprintf(
-				stdout,
-				"%50s\r%d message%s transmitted\n",
-				"",
-				msgcount,
-				msgcount == 1 ? "" : "s");
-			fflush(stdout);
-		}
-	}
+		case PH_CHUNK:
+		case PH_BDAT:
+			chunk_reply(sp);
+			break;
 
-	/* Send QUIT to close the conversation */
+		case PH_DOT:
+			dot_reply(sp);
+			break;
 
-#ifdef	DEBUG
-	trace("QUIT");
-#endif
-	sock_puts("QUIT\n", sockno, WTIMEOUT);
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
+		case PH_RSET:
+			rset_reply(sp);
+			break;
 
-	/* Handle the reply to QUIT */
+		case PH_IDLE:
+			idle_reply(sp);
+			break;
 
-	if(rbuf[0] != '2') {		/* Some kind of failure */
-		error("QUIT failed: %s", rbuf);
-		dolog(LOG_ERR, rbuf);
-		return(FALSE);
-	}
-	dolog(LOG_INFO, rbuf);
+		case PH_NOOP:
+			noop_reply(sp);
+			break;
 
-	if(domain[0] == '\0') {		/* Not ETRN case */
-		sprintf(
-			rbuf,
-			"[%d message%s sent]",
-			msgcount,
-			msgcount == 1 ? "" : "s");
-		dolog(LOG_INFO, rbuf);
-	} else {
-		if(etrn_rc == TRUE) {
-			sprintf(
-				rbuf,
-				"[ETRN sent for %s]",
-				domain);
-			dolog(LOG_INFO, rbuf);
-		}
+		case PH_QUIT:
+			quit_reply(sp);
+			break;
 	}
-
-	return(TRUE);
 }
 
 
 /*
- * Process SMTP extensions, ignoring ones we do not support.
- * The extension lines start with 250, with '-' in the fourth column
- * for all but the last line.
+ * Handle the reply to EHLO.
+ *	250 => EHLO recognised and implemented, so process reply
+ *	500 => EHLO not recognised, so try HELO
+ *	502 => EHLO recognised but not implemented, so try HELO
  *
  */
 
-static BOOL process_extensions(INT sockno)
-{	BOOL rc;
-	BOOL going = TRUE;
-	PUCHAR p;
+static VOID ehlo_reply(PSESSION sp)
+{	INT code;
+
+	code = (sp->rbuf[0] - '0')*100 +
+		(sp->rbuf[1] - '0')*10 +
+		(sp->rbuf[2] - '0');
+
+	switch(code) {
+		case 500:
+		case 502:		/* OK, try HELO */
+			sprintf(sp->wbuf, "HELO %s\n", sp->clientname);
+			send_command(sp);
+			sp->phase = PH_HELO;
+			break;
+
+		case 250:
+			if(sp->rlines != 0) {	/* Extensions listed */
+				sp->extensions = TRUE;
+				ehlo_line(sp, sp->rbuf);
+				if(sp->conn.sockno == -1) break;
+			}
+			start_tls(sp);
+			break;
 
-	while(going) {
-		rc = get_reply(sockno, rbuf);
-		if(rc == FALSE) return(FALSE);
+		default:
+			error("EHLO failed: %s", sp->rbuf);
+			dolog(LOG_ERR, sp->rbuf);
+			finish(sp, FALSE);
+			break;
+	}
+}
 
-		/* Valid responses are a 250 reply code, with a 250-
-		   indicating more to come. */
 
-		if(strnicmp(rbuf, "250", 3) != 0) return(FALSE);
-		if(rbuf[3] != '-') going = FALSE;	/* Last one */
+/*
+ * Process one line of the reply to EHLO, which names an SMTP extension.
+ * Extensions we do not support are ignored. The extension lines start
+ * with 250, with '-' in the fourth column for all but the last line.
+ *
+ */
 
-		p = &rbuf[4];
-		while((*p == ' ') || (*p == '\t')) p++;
+static VOID ehlo_line(PSESSION sp, PUCHAR line)
+{	PUCHAR p;
 
-		if(strnicmp(p, "AUTH", 4) == 0) {
-			process_extension_auth(p);
-			if(authmech == -1) {
-				p[strlen(p)-1] = '\0';/* Lose newline */
-				p += 4;	/* Lose leading AUTH */
-				error("authorisation mechanisms not supported");
-				error("server said it supports: %s", p);
-				return(FALSE);
-			}
-		}
+	/* Valid responses are a 250 reply code, with a 250-
+	   indicating more to come. */
 
-		/* Ignore other extensions */
+	if(strnicmp(line, "250", 3) != 0) {
+		finish(sp, FALSE);
+		return;
 	}
 
-	return(TRUE);
+	p = &line[4];
+	while((*p == ' ') || (*p == '\t')) p++;
+
+	if(strnicmp(p, "AUTH", 4) == 0) {
+		process_extension_auth(sp, p);
+		if(sp->authmech == -1) {
+			p[strlen(p)-1] = '\0';	/* Lose newline */
+			p += 4;			/* Lose leading AUTH */
+			error("authorisation mechanisms not supported");
+			error("server said it supports: %s", p);
+			finish(sp, FALSE);
+			return;
+		}
+	}
+
+	if(strnicmp(p, "PIPELINING", 10) == 0) sp->pipelining = TRUE;
+	if(strnicmp(p, "CHUNKING", 8) == 0) sp->chunking = TRUE;
+	if(strnicmp(p, "SIZE", 4) == 0) sp->sizeext = TRUE;
+	if(strnicmp(p, "STARTTLS", 8) == 0) sp->starttls = TRUE;
+
+	/* Ignore other extensions */
 }
 
 
@@ -293,10 +641,11 @@ static BOOL process_extensions(INT sockno)
  *
  */
 
-static VOID process_extension_auth(PUCHAR s)
+static VOID process_extension_auth(PSESSION sp, PUCHAR s)
 {	PUCHAR item;
 	PAUTHTYPE q;
 	INT code;
+	INT authsupp;			/* Bitmap of supported auth types */
 	UCHAR buf[RBUFSIZE+1];
 
 	strcpy(buf, s);			/* Work on copy */
@@ -340,414 +689,575 @@ static VOID process_extension_auth(PUCHAR s)
 	code = 0;
 	while(authsupp != 0) {
 		if((authsupp & 1) != 0) {
-			authmech = code;
+			sp->authmech = code;
 			break;
 		}
 		code++;
 		authsupp = authsupp >> 1;
 	}
 #ifdef	DEBUG
-	trace("Auth mechanism chosen = %d", authmech);
+	trace("Auth mechanism chosen = %d", sp->authmech);
 #endif
 }
 
 
 /*
- * Perform LOGIN style authorisation.
+ * We are now talking to the server. Start TLS if the server offers it and
+ * it is wanted (and not already in use); otherwise go on to authorisation.
  *
  */
 
-static BOOL do_auth_login(INT sockno, PUCHAR username, PUCHAR password)
-{	INT rc;
-	UCHAR temp[WBUFSIZE];
-
-	strcpy(wbuf, "AUTH LOGIN\n");
-#ifdef	DEBUG
-	trace(wbuf);
-#endif
-	sock_puts(wbuf, sockno, WTIMEOUT);
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
-	if((rbuf[0] != '3') && (rbuf[1] != '3') && (rbuf[2] != '4')) {
-			/* Unexpected response */
-		error("AUTH LOGIN failed: %s", rbuf);
-		dolog(LOG_ERR, rbuf);
-		return(FALSE);
-	}
-
-	sprintf(wbuf, "%s\n", enbase64(username, strlen(username), temp));
-#ifdef	DEBUG
-	trace(wbuf);
-#endif
-	sock_puts(wbuf, sockno, WTIMEOUT);
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
-	if((rbuf[0] != '3') && (rbuf[1] != '3') && (rbuf[2] != '4')) {
-			/* Unexpected response */
-		error("AUTH LOGIN response 1 failed: %s", rbuf);
-		dolog(LOG_ERR, rbuf);
-		return(FALSE);
+static VOID start_tls(PSESSION sp)
+{	if(sp->tlsmode == TLS_OFF || sp->secure == TRUE) {
+		start_auth(sp);
+		return;
 	}
 
-	sprintf(wbuf, "%s\n", enbase64(password, strlen(password), temp));
-#ifdef	DEBUG
-	trace(wbuf);
-#endif
-	sock_puts(wbuf, sockno, WTIMEOUT);
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
-	if((rbuf[0] != '2') && (rbuf[1] != '3') && (rbuf[2] != '5')) {
-			/* Unexpected response */
-		error("AUTH LOGIN response 2 failed: %s", rbuf);
-		dolog(LOG_ERR, rbuf);
-		return(FALSE);
+	if(sp->starttls == FALSE) {
+		if(sp->tlsmode == TLS_MUST) {
+			error("server does not support STARTTLS");
+			dolog(LOG_ERR, "server does not support STARTTLS");
+			finish(sp, FALSE);
+			return;
+		}
+		start_auth(sp);
+		return;
 	}
 
-	return(TRUE);
+	strcpy(sp->wbuf, "STARTTLS\n");
+	send_command(sp);
+	sp->phase = PH_STARTTLS;
 }
 
 
 /*
- * Perform PLAIN style authorisation.
+ * Handle the reply to STARTTLS. If the server is ready, the TLS handshake
+ * is started; it is driven from 'session_event', since it needs the
+ * socket to be readable or writable, and not a reply. If the server
+ * refuses, carry on without TLS unless it is required.
  *
  */
 
-static BOOL do_auth_plain(INT sockno, PUCHAR username, PUCHAR password)
-{	INT rc, authlen;
-	UCHAR temp[WBUFSIZE];
-	UCHAR authstr[WBUFSIZE];
-	PUCHAR p = &authstr[0];
-
-	*p++ = '\0';			/* No authentication name */
-	strcpy(p, username);
-	p += strlen(username);		/* To null terminator */
-	p++;				/* Beyond null terminator */
-	strcpy(p, password);
-	p += strlen(password);		/* To null terminator */
-	p++;				/* Beyond null terminator */
-	authlen = p - &authstr[0];
-
-	sprintf(wbuf, "AUTH PLAIN %s\n", enbase64(authstr, authlen, temp));
-#ifdef	DEBUG
-	trace(wbuf);
+static VOID tls_reply(PSESSION sp)
+{
+#ifdef	TLS
+	PVOID tls;
 #endif
-	sock_puts(wbuf, sockno, WTIMEOUT);
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
-	if((rbuf[0] != '2') && (rbuf[1] != '3') && (rbuf[2] != '5')) {
-			/* Unexpected response */
-		error("AUTH PLAIN failed: %s", rbuf);
-		dolog(LOG_ERR, rbuf);
-		return(FALSE);
+
+	if(sp->rbuf[0] != '2') {
+		if(sp->tlsmode == TLS_MUST) {
+			error("STARTTLS failed: %s", sp->rbuf);
+			dolog(LOG_ERR, sp->rbuf);
+			finish(sp, FALSE);
+			return;
+		}
+		dolog(LOG_WARNING, sp->rbuf);
+		start_auth(sp);
+		return;
 	}
 
-	return(TRUE);
+#ifdef	TLS
+	tls = tls_new();
+	if(tls == (PVOID) NULL) {
+		error("cannot start TLS");
+		finish(sp, FALSE);
+		return;
+	}
+	sock_starttls(sp->net, tls);
+	sp->tlsstart = engine_now();
+	sp->phase = PH_HANDSHAKE;
+#endif
 }
 
 
+#ifdef	TLS
 /*
- * Process a single directory. Iterate over the files in the directory,
- * passing them down to 'process_file'.
+ * Advance the TLS handshake. When it is complete, the session starts
+ * again with EHLO, over TLS; what the server said before is forgotten,
+ * since it may now offer different extensions.
  *
  * Returns:
- *	TRUE		directory processed OK
- *	FALSE		failed
+ *	TRUE		handshake complete; carry on with the session
+ *	FALSE		handshake still in progress (and the events needed set
+ *			up), or failed
  *
  */
 
-static BOOL process_directory(INT sockno, PUCHAR dirname, BOOL verbose)
-{	APIRET rc;
-	HDIR hdir = HDIR_CREATE;
-	ULONG count;
-	FILEFINDBUF3 entry;
-	UCHAR fullname[CCHMAXPATH+1];
-	UCHAR mask[CCHMAXPATH+3];
-
-#ifdef	DEBUG
-	trace("process_dir : %s\n", dirname);
-#endif
-
-	strcpy(mask, dirname);
-	strcat(mask, "\\*");		/* Form search mask */
-
-	count = 1;
-	rc = DosFindFirst(
-		mask,
-		&hdir,
-		FILE_NORMAL,
-		&entry,
-		sizeof(entry),
-		&count,
-		FIL_STANDARD);
-	if(rc == ERROR_NO_MORE_FILES) return(TRUE);
-	if(rc == ERROR_PATH_NOT_FOUND) {
-		error("directory '%s' does not exist", dirname);
-		return(FALSE);
-	}
-	if(rc != NO_ERROR) {
-		error("DosFindFirst failed, rc = %d", rc);
-		return(FALSE);
-	}
+static BOOL handshake(PSESSION sp)
+{	switch(sock_handshake(sp->net)) {
+		case 0:
+			break;
 
-	while(count != 0) {
-		strcpy(fullname, dirname);
-		strcat(fullname, "\\");
-		strcat(fullname, entry.achName);
-		(VOID) process_file(sockno, fullname, verbose);
+		case SOCKIO_WANTREAD:
+			sp->conn.events = EV_READ;
+			sp->conn.deadline = engine_now() + RTIMEOUT*1000;
+			return(FALSE);
 
-		count = 1;
-		rc = DosFindNext(
-			hdir,
-			&entry,
-			sizeof(entry),
-			&count);
+		case SOCKIO_WANTWRITE:
+			sp->conn.events = EV_WRITE;
+			sp->conn.deadline = engine_now() + WTIMEOUT*1000;
+			return(FALSE);
 
-		if(rc == ERROR_NO_MORE_FILES) break;
-		if(rc != NO_ERROR) {
-			error("DosFindNext failed, rc = %d", rc);
+		default:
+			error("TLS handshake failed");
+			dolog(LOG_ERR, "TLS handshake failed");
+			finish(sp, FALSE);
 			return(FALSE);
-		}
 	}
 
-	(VOID) DosFindClose(hdir);
+	tls_started(sp->net->tls, engine_now() - sp->tlsstart);
+	sp->secure = TRUE;
+
+	sp->extensions = FALSE;
+	sp->authmech = AUTH_NONE;
+	sp->pipelining = FALSE;
+	sp->chunking = FALSE;
+	sp->sizeext = FALSE;
+	sp->starttls = FALSE;
+
+	sprintf(sp->wbuf, "EHLO %s\n", sp->clientname);
+	send_command(sp);
+	sp->phase = PH_EHLO;
 
 	return(TRUE);
 }
+#endif
 
 
 /*
- * Process a single file.
- *
- * Returns:
- *	TRUE		file processed OK
- *	FALSE		failed
+ * See if authorisation is needed, and if so, start it.
  *
  */
 
-static BOOL process_file(INT sockno, PUCHAR name, BOOL verbose)
-{	FILE *fp;
-	UCHAR mes[MAXMES+1];
-	STATE state = ST_MAIL;
-	UCHAR buf[MAXLINE+1];
-	INT file_error = FALSE;
-	INT line = 0;
-	BOOL rc;
+static VOID start_auth(PSESSION sp)
+{	INT authlen;
+	UCHAR temp[WBUFSIZE];
+	UCHAR authstr[WBUFSIZE];
+	PUCHAR p;
 
-#ifdef	DEBUG
-	trace("process_file : %s\n", name);
-#endif
+	if(sp->username[0] == '\0') sp->authmech = AUTH_NONE;
 
-	fp = fopen(name, "r");
-	if(fp == (FILE *) NULL) {
-		sprintf(mes, "cannot open mail file %s", name);
-		error(mes);
-		dolog(LOG_ERR, mes);
-		return(FALSE);
-	}
+	sp->phase = PH_AUTH;
+	sp->step = 0;
 
-	if(verbose == TRUE) {
-		fprintf(stdout, "Transmitting message %d\r", msgcount + 1);
-		fflush(stdout);
-	}
+	switch(sp->authmech) {
+		case AUTH_NONE:
+			start_work(sp);
+			break;
 
-	while(fgets(buf, MAXLINE, fp) != (PUCHAR) NULL) {
-		line++;
-		if(buf[strlen(buf)-1] != '\n') {
-			sprintf(mes, "line %d too long in mail file %s",
-				line, name);
-			error(mes);
-			dolog(LOG_WARNING, mes);
-			file_error = TRUE;
-			break;
-		}
-
-		switch(state) {
-			case ST_MAIL:		/* Expecting MAIL command */
-				if(strnicmp(buf, "MAIL", 4) != 0) {
-					sprintf(
-						mes,
-						"MAIL line error in mail file"
-						" %s",
-						name);
-					error(mes);
-					dolog(LOG_ERR, mes);
-					file_error = TRUE;
-				} else state = ST_RCPT;
-				break;
+		case AUTH_LOGIN:	/* Perform LOGIN style authorisation */
+			strcpy(sp->wbuf, "AUTH LOGIN\n");
+			send_command(sp);
+			break;
 
-			case ST_RCPT:
-				if(strnicmp(buf, "RCPT", 4) != 0) {
-					sprintf(
-						mes,
-						"RCPT line error in mail file"
-						" %s",
-						name);
-					error(mes);
-					dolog(LOG_ERR, mes);
-					file_error = TRUE;
-				} else state = ST_RCPT_OR_DATA;
-				break;
+		case AUTH_PLAIN:	/* Perform PLAIN style authorisation */
+			p = &authstr[0];
+			*p++ = '\0';		/* No authentication name */
+			strcpy(p, sp->username);
+			p += strlen(sp->username);	/* To null terminator */
+			p++;			/* Beyond null terminator */
+			strcpy(p, sp->password);
+			p += strlen(sp->password);	/* To null terminator */
+			p++;			/* Beyond null terminator */
+			authlen = p - &authstr[0];
 
-			case ST_RCPT_OR_DATA:
-				if(strnicmp(buf, "RCPT", 4) == 0) break;
-				state = ST_DATA;
-				/* drop through */
-
-			case ST_DATA:
-				if(strnicmp(buf, "DATA", 4) != 0) {
-					sprintf(
-						mes,
-						"DATA line error in mail file"
-						" %s",
-						name);
-					error(mes);
-					dolog(LOG_ERR, mes);
-					file_error = TRUE;
-				} else state = ST_DATASTART;
-				break;
+			sprintf(
+				sp->wbuf,
+				"AUTH PLAIN %s\n",
+				enbase64(authstr, authlen, temp));
+			send_command(sp);
+			break;
 
-			case ST_DATASTART:
-				state = ST_TEXT;
-				/* drop through */
+		default:
+			error("internal error (bad authmech");
+			finish(sp, FALSE);
+			break;
+	}
+}
 
-			case ST_TEXT:		/* Just pass text through, but
-						   dot-stuff if necessary */
-				break;
-		}
-		if(file_error == TRUE) break;
 
-		/* A valid line has been read from the mail file, in context.
-		   Send it to the server. */
+/*
+ * Handle a reply during authorisation. LOGIN takes three steps (the
+ * command, then the username, then the password); PLAIN takes one.
+ *
+ */
 
-#ifdef	DEBUG
-		trace(buf);
-#endif
-		if(state == ST_TEXT && buf[0] == '.') {	/* Dot-stuff */
-			memmove(&buf[1], &buf[0], strlen(buf)+1);
-			buf[0] = '.';
-		}
-		sock_puts(buf, sockno, WTIMEOUT);
-		if(state == ST_TEXT) continue;	/* No response expected */
-		rc = get_reply(sockno, rbuf);
-		if(rc == FALSE) return(FALSE);
-		if(rbuf[0] != '2' && rbuf[0] != '3') {	/* Some kind of failure */
-			error("%s failed: %s", cmdname(state), rbuf);
-			dolog(LOG_ERR, rbuf);
-			return(FALSE);
+static VOID auth_reply(PSESSION sp)
+{	UCHAR temp[WBUFSIZE];
+	PUCHAR r = sp->rbuf;
+
+	if(sp->authmech == AUTH_PLAIN) {
+		if((r[0] != '2') && (r[1] != '3') && (r[2] != '5')) {
+				/* Unexpected response */
+			error("AUTH PLAIN failed: %s", r);
+			dolog(LOG_ERR, r);
+			finish(sp, FALSE);
+			return;
 		}
+		start_work(sp);
+		return;
 	}
 
-	if(!feof(fp)) {			/* Not end of file, but read error */
-		if(file_error == FALSE) {
-			sprintf(mes, "read error on mail file %s", name);
-			error(mes);
-			dolog(LOG_ERR, mes);
-		}
-		(VOID) fclose(fp);
-	} else {
-		strcpy(buf, ".\n");
-#ifdef	DEBUG
-		trace(buf);
-#endif
-		sock_puts(buf, sockno, WTIMEOUT);
-		rc = get_reply(sockno, rbuf);
-		if(rc == FALSE) return(FALSE);
-		if(rbuf[0] != '2') {		/* Some kind of failure */
-			error("text terminate failed: %s", rbuf);
-			dolog(LOG_ERR, rbuf);
-			return(FALSE);
-		}
-		(VOID) fclose(fp);
-		remove(name);
-	}
+	switch(sp->step) {
+		case 0:			/* Reply to AUTH LOGIN */
+			if((r[0] != '3') && (r[1] != '3') && (r[2] != '4')) {
+					/* Unexpected response */
+				error("AUTH LOGIN failed: %s", r);
+				dolog(LOG_ERR, r);
+				finish(sp, FALSE);
+				return;
+			}
+			sprintf(
+				sp->wbuf,
+				"%s\n",
+				enbase64(
+					sp->username,
+					strlen(sp->username),
+					temp));
+			send_command(sp);
+			break;
 
-	msgcount++;
-	return(TRUE);
+		case 1:			/* Reply to username */
+			if((r[0] != '3') && (r[1] != '3') && (r[2] != '4')) {
+					/* Unexpected response */
+				error("AUTH LOGIN response 1 failed: %s", r);
+				dolog(LOG_ERR, r);
+				finish(sp, FALSE);
+				return;
+			}
+			sprintf(
+				sp->wbuf,
+				"%s\n",
+				enbase64(
+					sp->password,
+					strlen(sp->password),
+					temp));
+			send_command(sp);
+			break;
+
+		default:		/* Reply to password */
+			if((r[0] != '2') && (r[1] != '3') && (r[2] != '5')) {
+					/* Unexpected response */
+				error("AUTH LOGIN response 2 failed: %s", r);
+				dolog(LOG_ERR, r);
+				finish(sp, FALSE);
+				return;
+			}
+			start_work(sp);
+			return;
+	}
+	sp->step++;
 }
 
 
 /*
- * See if there is anything to send.
- *
- * Returns TRUE if there is at least one message; otherwise returns FALSE.
+ * Start the real work of the session; either send ETRN, or start sending
+ * messages.
  *
  */
 
-BOOL something(PFL filelist)
-{	while(filelist != (PFL) NULL) {
-		if(filelist->isdir == TRUE) {
-			if(directory_not_empty(filelist->name) == TRUE)
-				return(TRUE);
-		} else {
-			if(access(filelist->name, 0) == 0) return(TRUE);
-		}
-		filelist = filelist->next;
+static VOID start_work(PSESSION sp)
+{	if(sp->domain[0] != '\0') {	/* Send an ETRN for a domain */
+		sprintf(sp->wbuf, "ETRN %s\n", sp->domain);
+		send_command(sp);
+		sp->phase = PH_ETRN;
+	} else {
+		next_message(sp);
 	}
-
-	return(FALSE);
 }
 
 
 /*
- * See if a directory has at least one file in it.
- *
- * Returns TRUE if directory is not empty, otherwise returns FALSE.
+ * Handle the reply to ETRN, then close the conversation.
  *
  */
 
-static BOOL directory_not_empty(PUCHAR dirname)
-{	APIRET rc;
-	HDIR hdir = HDIR_CREATE;
-	ULONG count;
-	FILEFINDBUF3 entry;
-	UCHAR mask[CCHMAXPATH+3];
-
-	strcpy(mask, dirname);
-	strcat(mask, "\\*");		/* Form search mask */
-
-	count = 1;
-	rc = DosFindFirst(
-		mask,
-		&hdir,
-		FILE_NORMAL,
-		&entry,
-		sizeof(entry),
-		&count,
-		FIL_STANDARD);
+static VOID etrn_reply(PSESSION sp)
+{	if(sp->rbuf[0] != '2' && sp->rbuf[0] != '3') {
+		/* Some kind of failure */
+		error("ETRN failed: %s", sp->rbuf);
+		dolog(LOG_ERR, sp->rbuf);
+		sp->etrn_ok = FALSE;
+	} else {
+		if(sp->verbose == TRUE) {
+			fprintf(stdout, "ETRN sent for %s\n", sp->domain);
+		}
+		sp->etrn_ok = TRUE;
+	}
 
-	(VOID) DosFindClose(hdir);
+	/* Send QUIT to close the conversation */
 
-	return(rc == NO_ERROR ? TRUE : FALSE);
+	strcpy(sp->wbuf, "QUIT\n");
+	send_command(sp);
+	sp->phase = PH_QUIT;
 }
 
 
 /*
- * Send an ETRN for a domain.
- *
- * Returns:
- *	TRUE if sent OK.
- *	FALSE if not sent OK.
+ * Handle the reply to QUIT, and log the results of the session.
  *
  */
 
-static BOOL do_etrn(INT sockno, PUCHAR domain, BOOL verbose)
-{	BOOL rc;
+static VOID quit_reply(PSESSION sp)
+{	if(sp->rbuf[0] != '2') {		/* Some kind of failure */
+		error("QUIT failed: %s", sp->rbuf);
+		dolog(LOG_ERR, sp->rbuf);
+		finish(sp, FALSE);
+		return;
+	}
+	dolog(LOG_INFO, sp->rbuf);
+
+	log_session(sp);
+	finish(sp, TRUE);
+}
+
+
+/*
+ * Log the results of a session that has ended normally.
+ *
+ */
+
+static VOID log_session(PSESSION sp)
+{	ULONG bytes, sends, saved;
+
+	if(sp->domain[0] == '\0') {		/* Not ETRN case */
+		summary(sp->rbuf, sp->msgcount, sp->deferred, sp->unsent);
+		dolog(LOG_INFO, sp->rbuf);
+	} else {
+		if(sp->etrn_ok == TRUE) {
+			sprintf(
+				sp->rbuf,
+				"[ETRN sent for %s]",
+				sp->domain);
+			dolog(LOG_INFO, sp->rbuf);
+		}
+	}
+
+	netio_stats(sp->net, &bytes, &sends, &saved);
+	sprintf(
+		sp->rbuf,
+		"[%lu bytes sent in %lu write%s, %lu saved by buffering]",
+		bytes,
+		sends,
+		sends == 1 ? "" : "s",
+		saved);
+	dolog(LOG_INFO, sp->rbuf);
+}
+
+
+/*
+ * Start sending the next message. If there are no more, send QUIT to
+ * close the conversation, or when running as a daemon, wait for more.
+ *
+ */
+
+static VOID next_message(PSESSION sp)
+{	PSPOOL spool;
+	UCHAR name[CCHMAXPATH+1];
+
+	while(prefetch_next(name, &spool) == TRUE) {
+		if(process_file(sp, name, spool) == TRUE) return;
+		outcome(sp, name, OUT_FAILED, "");
+	}
+
+	if(sp->work->watch == TRUE) {
+		start_idle(sp);
+		return;
+	}
+
+	strcpy(sp->wbuf, "QUIT\n");
+	send_command(sp);
+	sp->phase = PH_QUIT;
+}
+
+
+/*
+ * Wait for more mail to send. Replies may still be awaited for the last
+ * message, when pipelining.
+ *
+ */
+
+static VOID start_idle(PSESSION sp)
+{	sp->phase = PH_IDLE;
+	sp->idlestart = engine_now();
+	sp->lastnoop = sp->idlestart;
+}
+
+
+/*
+ * Called every IDLETICK while a session is idle. Any new mail is started
+ * at once. If there is none, and no session has anything in progress,
+ * that is noted, so that the files not sent can be retried (see
+ * prefetch.c). NOOP is sent every KEEPALIVE seconds, and the session is
+ * closed once it has been idle for IDLELIMIT seconds.
+ *
+ */
+
+static VOID idle_timer(PSESSION sp)
+{	ULONG now = engine_now();
+
+	if(sp->dotwait == TRUE || sp->rsetwait == TRUE) {
+		if(now - sp->idlestart >= RTIMEOUT*1000) {
+			error("network read timeout");
+			finish(sp, FALSE);
+		}
+		return;
+	}
+
+	if(prefetch_ready() == TRUE) {
+		next_message(sp);
+		return;
+	}
+
+	if(now - sp->idlestart >= IDLELIMIT*1000) {
+		strcpy(sp->wbuf, "QUIT\n");
+		send_command(sp);
+		sp->phase = PH_QUIT;
+		return;
+	}
+
+	if(now - sp->lastnoop >= KEEPALIVE*1000) {
+		strcpy(sp->wbuf, "NOOP\n");
+		send_command(sp);
+		sp->lastnoop = now;
+		sp->phase = PH_NOOP;
+		return;
+	}
+
+	if(sp->work->quiet == sp->work->sessions) prefetch_quiet();
+}
+
+
+/*
+ * Handle a reply received while idle, with nothing awaiting one. This
+ * is normally the server closing the connection (421), perhaps because
+ * of its own idle timeout; that is not treated as an error.
+ *
+ */
+
+static VOID idle_reply(PSESSION sp)
+{	if(sp->rbuf[0] == '4' && sp->rbuf[1] == '2' && sp->rbuf[2] == '1') {
+		dolog(LOG_INFO, sp->rbuf);
+		log_session(sp);
+		finish(sp, TRUE);
+		return;
+	}
+
+	error("unexpected reply: %s", sp->rbuf);
+	dolog(LOG_ERR, sp->rbuf);
+	finish(sp, FALSE);
+}
+
+
+/*
+ * Handle the reply to NOOP, sent to keep an idle connection alive.
+ *
+ */
+
+static VOID noop_reply(PSESSION sp)
+{	if(sp->rbuf[0] != '2') {		/* Some kind of failure */
+		idle_reply(sp);
+		return;
+	}
+
+	sp->phase = PH_IDLE;
+}
+
+
+/*
+ * Start processing a single file, already opened as 'spool' (or NULL if it
+ * could not be), by sending the first envelope command (or, when
+ * pipelining, the first batch of them).
+ *
+ * Returns:
+ *	TRUE		file started OK
+ *	FALSE		failed
+ *
+ */
+
+static BOOL process_file(PSESSION sp, PUCHAR name, PSPOOL spool)
+{	UCHAR mes[MAXMES+CCHMAXPATH+1];
 
-	sprintf(wbuf, "ETRN %s\n", domain);
 #ifdef	DEBUG
-	trace(wbuf);
+	trace("process_file : %s\n", name);
 #endif
-	sock_puts(wbuf, sockno, WTIMEOUT);
-	rc = get_reply(sockno, rbuf);
-	if(rc == FALSE) return(FALSE);
-	if(rbuf[0] != '2' && rbuf[0] != '3') {	/* Some kind of failure */
-		error("ETRN failed: %s", rbuf);
-		dolog(LOG_ERR, rbuf);
+
+	sp->spool = spool;
+	if(sp->spool == (PSPOOL) NULL) {
+		sprintf(mes, "cannot open mail file %s", name);
+		error(mes);
+		dolog(LOG_ERR, mes);
 		return(FALSE);
 	}
+	strcpy(sp->fname, name);
+	sp->state = ST_MAIL;
+	sp->sent = ST_MAIL;
+	sp->outstanding = 0;
+	sp->replies = 0;
+	sp->failed = FALSE;
+	sp->freply[0] = '\0';
+	sp->sender[0] = '\0';
+	sp->rcpts = 0;
+	sp->line = 0;
+	sp->phase = PH_ENVELOPE;
+
+	if(sp->verbose == TRUE) {
+		fprintf(stdout, "Transmitting message %d\r",
+			++sp->work->started);
+		fflush(stdout);
+	}
+
+	return(send_batch(sp));
+}
+
+
+/*
+ * Send envelope commands for the current file. Without pipelining, one
+ * command is sent at a time. With it, the MAIL command and the RCPT
+ * commands are sent together, up to a limit on the number awaiting
+ * reply, or until the output buffer is nearly full; the rest follow as
+ * replies come in. In either case, DATA is only sent once all of the
+ * replies have been received, so that the message is not sent unless
+ * every recipient has been accepted. If the server supports CHUNKING,
+ * the text is sent using BDAT instead of DATA.
+ *
+ * Returns:
+ *	TRUE		commands sent; replies awaited
+ *	FALSE		error in mail file (reported) with no replies
+ *			outstanding; file abandoned
+ *
+ */
+
+static BOOL send_batch(PSESSION sp)
+{	INT window = sp->pipelining == TRUE ? MAXPIPE : 1;
+
+	while(sp->state != ST_DATASTART && sp->outstanding < window) {
+		if(sp->outstanding != 0 && sock_room(sp->net) < WBUFSIZE)
+			break;		/* Buffer full; wait for replies */
+		if(send_envelope(sp) == FALSE) {
+			if(sp->outstanding == 0) return(FALSE);
+			sp->failed = TRUE;	/* Absorb replies first */
+			return(TRUE);
+		}
+	}
 
-	if(verbose == TRUE) {
-		fprintf(stdout, "ETRN sent for %s\n", domain);
+	if(sp->state == ST_DATASTART && sp->outstanding == 0 &&
+	   sp->chunking == TRUE) {
+		sp->state = ST_TEXT;
+		sp->rejected = FALSE;
+		sp->csize = CHUNKMIN < sp->chunkmax ? CHUNKMIN : sp->chunkmax;
+		if(start_chunk(sp) == FALSE) {
+			spool_close(sp->spool);
+			sp->spool = (PSPOOL) NULL;
+			return(FALSE);
+		}
+	}
+
+	if(sp->state == ST_DATASTART && sp->outstanding == 0) {
+		strcpy(sp->wbuf, "DATA\n");
+		send_command(sp);
+		sp->sent = ST_DATA;
+		sp->outstanding++;
 	}
 
 	return(TRUE);
@@ -755,36 +1265,719 @@ static BOOL do_etrn(INT sockno, PUCHAR domain, BOOL verbose)
 
 
 /*
- * Read a reply from the server.
+ * Read the next envelope line (MAIL, RCPT or DATA) from the mail file,
+ * check that it is valid in context, and send it to the server. The DATA
+ * line is not sent here, but left for 'send_batch'.
  *
  * Returns:
- *	TRUE if reply read OK.
- *	FALSE if network read error.
+ *	TRUE		command sent, or DATA line reached
+ *	FALSE		error in mail file (reported); file abandoned
  *
  */
 
-static BOOL get_reply(INT sockno, PUCHAR buf)
+static BOOL send_envelope(PSESSION sp)
 {	INT rc;
+	UCHAR mes[MAXMES+CCHMAXPATH+1];
+	BOOL file_error = FALSE;
+	PUCHAR buf;
+
+	rc = spool_line(sp->spool, &buf);
+	if(rc <= 0) {
+		if(rc == SPOOL_ERR) {
+			read_error(sp);
+		} else {
+			if(rc == SPOOL_TOOLONG)
+				sprintf(mes, "line %d too long in mail file"
+					" %s", sp->line+1, sp->fname);
+			else if(rc == SPOOL_FORMAT)
+				sprintf(mes, "unknown format of mail file %s",
+					sp->fname);
+			else
+				sprintf(mes, "premature end of mail file %s",
+					sp->fname);
+			error(mes);
+			dolog(LOG_ERR, mes);
+		}
+		spool_close(sp->spool);
+		sp->spool = (PSPOOL) NULL;
+		return(FALSE);
+	}
+	sp->line++;
+
+	switch(sp->state) {
+		case ST_MAIL:		/* Expecting MAIL command */
+			if(strnicmp(buf, "MAIL", 4) != 0) {
+				sprintf(
+					mes,
+					"MAIL line error in mail file"
+					" %s",
+					sp->fname);
+				error(mes);
+				dolog(LOG_ERR, mes);
+				file_error = TRUE;
+			} else {
+				note_sender(sp, buf);
+				sp->sent = ST_MAIL;
+				sp->state = ST_RCPT;
+			}
+			break;
+
+		case ST_RCPT:
+			if(strnicmp(buf, "RCPT", 4) != 0) {
+				sprintf(
+					mes,
+					"RCPT line error in mail file"
+					" %s",
+					sp->fname);
+				error(mes);
+				dolog(LOG_ERR, mes);
+				file_error = TRUE;
+			} else {
+				sp->sent = ST_RCPT;
+				sp->state = ST_RCPT_OR_DATA;
+				sp->rcpts++;
+			}
+			break;
+
+		case ST_RCPT_OR_DATA:
+			if(strnicmp(buf, "RCPT", 4) == 0) {
+				sp->sent = ST_RCPT;
+				sp->rcpts++;
+				break;
+			}
+			sp->state = ST_DATA;
+			/* drop through */
+
+		case ST_DATA:
+			if(strnicmp(buf, "DATA", 4) != 0) {
+				sprintf(
+					mes,
+					"DATA line error in mail file"
+					" %s",
+					sp->fname);
+				error(mes);
+				dolog(LOG_ERR, mes);
+				file_error = TRUE;
+			} else if(spool_envelope(sp->spool, sp->rcpts) ==
+					FALSE) {
+				sprintf(
+					mes,
+					"envelope does not match header in"
+					" mail file %s",
+					sp->fname);
+				error(mes);
+				dolog(LOG_ERR, mes);
+				file_error = TRUE;
+			} else {
+				sp->state = ST_DATASTART;
+				qindex_envelope(sp->fname, sp->sender,
+						sp->rcpts);
+			}
+			break;
+	}
+
+	if(file_error == TRUE) {
+		spool_close(sp->spool);
+		sp->spool = (PSPOOL) NULL;
+		return(FALSE);
+	}
+
+	/* A valid line has been read from the mail file, in context.
+	   Send it to the server. */
+
+	if(sp->state == ST_DATASTART) return(TRUE);
+
+	/* If the size of the text is known, and the server wants it, say
+	   what it is, so that a message that is too large can be refused
+	   before it is sent */
+
+	if(sp->sent == ST_MAIL && sp->sizeext == TRUE &&
+	   spool_size(sp->spool) != 0 && rc + 20 < WBUFSIZE) {
+		sprintf(sp->wbuf, "%.*s SIZE=%lu\n", rc - 1, buf,
+			spool_size(sp->spool));
+		buf = sp->wbuf;
+	}
+
+#ifdef	DEBUG
+	trace(buf);
+#endif
+	sock_puts(sp->net, buf);
+	sp->outstanding++;
 
-	rc = sock_gets(buf, RBUFSIZE, sockno, RTIMEOUT);
-	if(rc < 0) {
+	return(TRUE);
+}
+
+
+/*
+ * Handle the reply to an envelope command. Replies arrive in the order
+ * that the commands were sent, so the first is for MAIL and the rest are
+ * for RCPT, until DATA is sent on its own. After DATA, start sending the
+ * message text; otherwise send more envelope commands.
+ *
+ * Once a command has failed, no more are sent, and the message is
+ * abandoned when the replies to those already sent have all arrived.
+ *
+ */
+
+static VOID envelope_reply(PSESSION sp)
+{	STATE cmd;
+
+	cmd = sp->sent == ST_DATA ? ST_DATA :
+		sp->replies == 0 ? ST_MAIL : ST_RCPT;
+	sp->replies++;
+	sp->outstanding--;
+
+	if(sp->rbuf[0] != '2' && sp->rbuf[0] != '3') {
+		/* Some kind of failure */
+		error("%s failed: %s", cmdname(cmd), sp->rbuf);
+		dolog(LOG_ERR, sp->rbuf);
+		if(sp->failed == FALSE) strcpy(sp->freply, sp->rbuf);
+		sp->failed = TRUE;
+	}
+
+	if(sp->failed == TRUE) {
+		if(sp->outstanding == 0) reset_message(sp);
+		return;
+	}
+
+	if(cmd == ST_DATA) {
+		sp->state = ST_TEXT;
+		sp->rejected = FALSE;
+		sp->phase = PH_TEXT;	/* Text is sent as room allows */
+		return;
+	}
+
+	if(send_batch(sp) == FALSE) reset_message(sp);
+}
+
+
+/*
+ * Send as much message text as the connection will take, dot-stuffing as
+ * necessary. At the end of the file, send the terminating dot and wait
+ * for the reply.
+ *
+ * The text is taken from the mail file in spans (see spool.c); a large
+ * span, such as a block of text that needs no alteration, is sent straight
+ * from the file buffer, and small ones are collected in the output buffer.
+ *
+ * Once DATA has been accepted, the only way to abandon a message is to
+ * drop the connection, so an error in the file ends the session.
+ *
+ */
+
+static VOID send_text(PSESSION sp)
+{	INT n, rc;
+	PUCHAR p;
+
+	for(;;) {
+		n = spool_span(sp->spool, &p, TRUE);
+		if(n == 0) break;	/* End of text */
+		if(n == SPOOL_ERR) {
+			read_error(sp);
+			finish(sp, FALSE);
+			return;
+		}
+
+		rc = sock_write(sp->net, p, n);
 		if(rc == SOCKIO_ERR) {
-			error("network read error");
-			return(FALSE);
+			error("network write error");
+			finish(sp, FALSE);
+			return;
 		}
-		if(rc == SOCKIO_TIMEOUT) {
-			error("network read timeout");
+		spool_skip(sp->spool, rc);
+		if(rc < n) return;	/* Wait for room */
+	}
+
+	spool_close(sp->spool);
+	sp->spool = (PSPOOL) NULL;
+
+	strcpy(sp->wbuf, ".\n");
+	send_command(sp);
+	strcpy(sp->dname, sp->fname);
+	sp->dotwait = TRUE;
+	sp->phase = PH_DOT;
+
+	/* When pipelining, the next message can be started (or the session
+	   ended) without waiting */
+
+	if(sp->pipelining == TRUE) next_message(sp);
+}
+
+
+/*
+ * Start sending the next BDAT chunk of the message text. The size of the
+ * chunks grows from one to the next, up to the maximum; a short message
+ * goes in one small chunk, and a long one is soon being sent in large
+ * ones.
+ *
+ * Returns:
+ *	TRUE		chunk started
+ *	FALSE		error reading mail file (reported)
+ *
+ */
+
+static BOOL start_chunk(PSESSION sp)
+{	if(fill_chunk(sp) == FALSE) return(FALSE);
+
+	sprintf(sp->wbuf, "BDAT %d%s\n", sp->clen,
+		sp->clast == TRUE ? " LAST" : "");
+	send_command(sp);
+	sp->coff = 0;
+	sp->chunks++;
+	sp->phase = PH_CHUNK;		/* Chunk is sent as room allows */
+
+	sp->csize *= 2;
+	if(sp->csize > sp->chunkmax) sp->csize = sp->chunkmax;
+
+	return(TRUE);
+}
+
+
+/*
+ * Fill the chunk buffer with the next 'csize' bytes of message text. The
+ * text sent using BDAT is not dot-stuffed, but every line must end in
+ * CR-LF; see spool.c.
+ *
+ * Returns:
+ *	TRUE		chunk filled; 'clast' set if the text is all there
+ *	FALSE		error reading mail file (reported)
+ *
+ */
+
+static BOOL fill_chunk(PSESSION sp)
+{	INT n;
+	PUCHAR p;
+
+	if(sp->chunk == (PUCHAR) NULL) {
+		sp->chunk = (PUCHAR) xmalloc(sp->chunkmax);
+		if(sp->chunk == (PUCHAR) NULL) return(FALSE);
+	}
+
+	sp->clen = 0;
+	sp->clast = FALSE;
+
+	n = spool_read(sp->spool, sp->chunk, sp->csize, FALSE);
+	if(n == SPOOL_ERR) {
+		read_error(sp);
+		return(FALSE);
+	}
+	sp->clen = n;
+
+	/* If the chunk is full, see if there is any more text to come */
+
+	if(n == sp->csize) {
+		n = spool_span(sp->spool, &p, FALSE);
+		if(n == SPOOL_ERR) {
+			read_error(sp);
 			return(FALSE);
 		}
-		if(rc == SOCKIO_TOOLONG) {
-			error("network input line too long");
-			return(FALSE);
+	}
+	if(n == 0 || sp->clen < sp->csize) sp->clast = TRUE;
+
+	return(TRUE);
+}
+
+
+/*
+ * Send as much of the current BDAT chunk as the connection will take. The
+ * chunk is sent straight from the chunk buffer, rather than being copied
+ * into the output buffer first; over TLS, this also lets it go in records
+ * of the largest size. Nothing else is sent until the chunk has gone.
+ * When it has all gone, go on to the next chunk; with pipelining, this is
+ * done at once, but otherwise only when the reply to this one arrives.
+ * After the last chunk, the next message is started (when pipelining) as
+ * it is after the end of text sent using DATA, but behind an RSET; the
+ * outcome of the BDAT commands is not yet known, and if they fail the
+ * state of the transaction is not clear until RSET has been sent.
+ *
+ */
+
+static VOID send_chunk(PSESSION sp)
+{	INT n;
+
+	for(;;) {
+		if(sp->coff < sp->clen) {
+			n = sock_write(sp->net, &sp->chunk[sp->coff],
+					sp->clen - sp->coff);
+			if(n == SOCKIO_ERR) {
+				error("network write error");
+				finish(sp, FALSE);
+				return;
+			}
+			sp->coff += n;
+			if(sp->coff < sp->clen) return;	/* Wait for room */
+		}
+
+		if(sp->clast == TRUE) {
+			spool_close(sp->spool);
+			sp->spool = (PSPOOL) NULL;
+			strcpy(sp->dname, sp->fname);
+			sp->dotwait = TRUE;
+			sp->phase = PH_DOT;
+			if(sp->pipelining == TRUE) {
+				strcpy(sp->wbuf, "RSET\n");
+				send_command(sp);
+				sp->rsetwait = TRUE;
+				next_message(sp);
+			}
+			return;
+		}
+
+		if(sp->pipelining == FALSE || sp->rejected == TRUE) {
+			sp->phase = PH_BDAT;	/* Wait for reply */
+			return;
+		}
+
+		if(start_chunk(sp) == FALSE) {
+			sp->rejected = TRUE;	/* Abandon message */
+			sp->phase = PH_BDAT;
+			return;
+		}
+	}
+}
+
+
+/*
+ * Handle the reply to a BDAT chunk other than the last. If a chunk is
+ * refused (or the next one cannot be read), no more are sent, and the
+ * message is abandoned when the replies to those already sent have
+ * arrived.
+ *
+ */
+
+static VOID chunk_reply(PSESSION sp)
+{	sp->chunks--;
+
+	if(sp->rbuf[0] != '2') {		/* Some kind of failure */
+		if(sp->rejected == FALSE) {
+			error("BDAT failed: %s", sp->rbuf);
+			dolog(LOG_ERR, sp->rbuf);
+			strcpy(sp->freply, sp->rbuf);
+		}
+		sp->rejected = TRUE;
+	}
+
+	if(sp->phase != PH_BDAT) return;	/* Not waiting for it */
+
+	if(sp->rejected == FALSE && start_chunk(sp) == FALSE)
+		sp->rejected = TRUE;
+	if(sp->rejected == TRUE && sp->chunks == 0) reset_message(sp);
+}
+
+
+/*
+ * Handle the reply to the end of the message text. If the message was
+ * accepted, the file can go. Unless the next message has already been
+ * started, start it now; but after text sent using BDAT has failed, RSET
+ * is sent first (when pipelining, it has been sent already).
+ *
+ */
+
+static VOID dot_reply(PSESSION sp)
+{	BOOL chunked = sp->chunks != 0 ? TRUE : FALSE;
+
+	sp->dotwait = FALSE;
+	sp->chunks = 0;
+
+	if(sp->rbuf[0] != '2' || sp->rejected == TRUE) {
+		/* Some kind of failure */
+		if(sp->rejected == FALSE) {
+			error("text terminate failed: %s", sp->rbuf);
+			dolog(LOG_ERR, sp->rbuf);
+			strcpy(sp->freply, sp->rbuf);
+		}
+		outcome(sp, sp->dname, refusal(sp->freply), sp->freply);
+		if(chunked == TRUE && sp->phase == PH_DOT) {
+			strcpy(sp->wbuf, "RSET\n");
+			send_command(sp);
+			sp->rsetwait = TRUE;
+			sp->phase = PH_RSET;
+			return;
+		}
+	} else {
+		outcome(sp, sp->dname, OUT_SENT, "");
+	}
+
+	if(sp->phase == PH_DOT) next_message(sp);
+}
+
+
+/*
+ * Abandon the current message, once the server has replied to everything
+ * sent for it, and send RSET to clear the transaction; the connection can
+ * then be used for the next message. When pipelining, that is started at
+ * once; otherwise, it waits for the reply to RSET.
+ *
+ */
+
+static VOID reset_message(PSESSION sp)
+{	if(sp->spool != (PSPOOL) NULL) {
+		spool_close(sp->spool);
+		sp->spool = (PSPOOL) NULL;
+	}
+	outcome(sp, sp->fname, refusal(sp->freply), sp->freply);
+
+	strcpy(sp->wbuf, "RSET\n");
+	send_command(sp);
+	sp->rsetwait = TRUE;
+	sp->phase = PH_RSET;
+
+	if(sp->pipelining == TRUE) next_message(sp);
+}
+
+
+/*
+ * Handle the reply to RSET. If it failed, the state of the conversation is
+ * unknown, so the session is ended.
+ *
+ */
+
+static VOID rset_reply(PSESSION sp)
+{	sp->rsetwait = FALSE;
+
+	if(sp->rbuf[0] != '2') {		/* Some kind of failure */
+		error("RSET failed: %s", sp->rbuf);
+		dolog(LOG_ERR, sp->rbuf);
+		finish(sp, FALSE);
+		return;
+	}
+
+	if(sp->phase == PH_RSET) next_message(sp);
+}
+
+
+/*
+ * Record the outcome of trying to send the message in file 'name'. A
+ * message that has been sent is removed. One that the server has refused
+ * for good, or that has been queued for too long (see qindex.c), is moved
+ * to the dead letter directory. Any other is returned to the spool for
+ * another attempt (see claim.c), and noted in the log, with the time until
+ * that attempt. 'reply' is the server's reply refusing the message, or
+ * empty if there was none.
+ *
+ */
+
+static VOID outcome(PSESSION sp, PUCHAR name, OUTCOME result, PUCHAR reply)
+{	UCHAR mes[MAXMES+2*CCHMAXPATH+1];
+	UCHAR dead[CCHMAXPATH+1];
+	LONG wait;
+
+	switch(result) {
+		case OUT_SENT:
+			claim_done(name);
+			qindex_done(name);
+			sp->msgcount++;
+			sp->work->msgcount++;
+			return;
+
+		case OUT_DEFERRED:
+			sp->deferred++;
+			sp->work->deferred++;
+			sprintf(mes, "message in %s deferred", name);
+			break;
+
+		case OUT_REJECTED:
+			sp->unsent++;
+			sp->work->unsent++;
+			sprintf(mes, "message in %s rejected", name);
+			if(dead_letter(name, reply, dead) == FALSE) break;
+			qindex_done(name);
+			sprintf(&mes[strlen(mes)], "; moved to %s", dead);
+			dolog(LOG_ERR, mes);
+			return;
+
+		case OUT_FAILED:
+			sp->unsent++;
+			sp->work->unsent++;
+			sprintf(mes, "message in %s not sent", name);
+			break;
+	}
+
+	wait = qindex_failed(name, reply);
+	if(wait == QI_EXPIRED) {
+		strcat(mes, "; too old, so not tried again");
+		if(dead_letter(name, reply, dead) == TRUE) {
+			qindex_done(name);
+			sprintf(&mes[strlen(mes)], "; moved to %s", dead);
+			dolog(LOG_ERR, mes);
+			return;
 		}
+	} else if(wait != 0)
+		sprintf(&mes[strlen(mes)], "; next attempt in %ld min%s",
+			(wait + 59)/60, (wait + 59)/60 == 1 ? "" : "s");
+	dolog(wait == QI_EXPIRED ? LOG_ERR : LOG_WARNING, mes);
+	claim_release(name);
+}
+
+
+/*
+ * Decide what the server's reply 'reply', refusing a message, means for
+ * it. A permanent failure (5xx) means that it will never be accepted.
+ *
+ * Returns the outcome (OUT_xxx).
+ *
+ */
+
+static OUTCOME refusal(PUCHAR reply)
+{	switch(reply[0]) {
+		case '4':			/* Temporary failure */
+			return(OUT_DEFERRED);
+
+		case '5':			/* Permanent failure */
+			return(OUT_REJECTED);
+
+		default:			/* Not the server's */
+			return(OUT_FAILED);
 	}
+}
+
+
+/*
+ * Move the mail file 'name' to the dead letter directory (DEADDIR) below
+ * the directory it is in, making that if need be, so that it is not tried
+ * again. The final reply from the server, 'reply', is kept in a file next
+ * to it, with REPLYEXT added to its name. The new name of the mail file is
+ * placed in 'dead'.
+ *
+ * Returns:
+ *	TRUE		file moved
+ *	FALSE		file could not be moved, and is left where it is
+ *
+ */
+
+static BOOL dead_letter(PUCHAR name, PUCHAR reply, PUCHAR dead)
+{	PUCHAR p;
+	INT len;
+	FILE *fp;
+	UCHAR path[CCHMAXPATH+1];
+	UCHAR rname[CCHMAXPATH+1];
+
+	p = strrchr(name, '\\');
+	len = p == (PUCHAR) NULL ? 0 : p - name + 1;
+	if(strlen(name) + strlen(DEADDIR) + strlen(REPLYEXT) + 1 > CCHMAXPATH)
+		return(FALSE);
+
+	memcpy(dead, name, len);
+	strcpy(&dead[len], DEADDIR);
+	(VOID) DosCreateDir(dead, (PEAOP2) NULL);	/* May exist already */
+	sprintf(&dead[len+strlen(DEADDIR)], "\\%s", &name[len]);
+	claim_path(name, path);
+	if(DosMove(path, dead) != NO_ERROR) return(FALSE);
+
+	sprintf(rname, "%s%s", dead, REPLYEXT);
+	fp = fopen(rname, "w");
+	if(fp != (FILE *) NULL) {
+		fprintf(fp, "%.*s\n", (INT) strcspn(reply, "\r\n"), reply);
+		fclose(fp);
+	}
+
+	return(TRUE);
+}
+
+
+/*
+ * Note the sender given by the MAIL line 'buf', for the queue index.
+ *
+ */
+
+static VOID note_sender(PSESSION sp, PUCHAR buf)
+{	PUCHAR p, q;
+	INT n = 0;
+
+	p = strchr(buf, '<');
+	if(p == (PUCHAR) NULL) return;
+	for(q = p+1; *q != '>' && *q != '\0' && n < QADDRLEN-1; q++)
+		sp->sender[n++] = *q;
+	sp->sender[n] = '\0';
+}
+
+
+/*
+ * Format a summary of the messages handled, for the log.
+ *
+ */
+
+static VOID summary(PUCHAR buf, INT sent, INT deferred, INT unsent)
+{	sprintf(buf, "[%d message%s sent", sent, sent == 1 ? "" : "s");
+	if(deferred != 0)
+		sprintf(&buf[strlen(buf)], ", %d deferred", deferred);
+	if(unsent != 0)
+		sprintf(&buf[strlen(buf)], ", %d not sent", unsent);
+	strcat(buf, "]");
+}
+
+
+/*
+ * Report a read error on the mail file being sent.
+ *
+ */
+
+static VOID read_error(PSESSION sp)
+{	UCHAR mes[MAXMES+CCHMAXPATH+1];
+
+	sprintf(mes, "read error on mail file %s", sp->fname);
+	error(mes);
+	dolog(LOG_ERR, mes);
+}
+
+
+/*
+ * Send the command in 'wbuf' to the server.
+ *
+ */
+
+static VOID send_command(PSESSION sp)
+{
 #ifdef	DEBUG
-	trace("%s", buf);
+	trace(sp->wbuf);
 #endif
-	return(TRUE);
+	sock_puts(sp->net, sp->wbuf);
+}
+
+
+/*
+ * End a session, successfully or otherwise. The connection is dropped
+ * from the event loop, but the socket is left for the caller to close.
+ * Any message still being sent is returned to the spool, to be tried
+ * again.
+ *
+ */
+
+static VOID finish(PSESSION sp, BOOL ok)
+{	if(sp->spool != (PSPOOL) NULL) {
+		spool_close(sp->spool);
+		sp->spool = (PSPOOL) NULL;
+		claim_release(sp->fname);
+	}
+	if(sp->dotwait == TRUE) claim_release(sp->dname);
+
+	sp->ok = ok;
+	sp->conn.sockno = -1;
+	sp->conn.events = 0;
+	sp->conn.deadline = 0;
+
+	set_quiet(sp);
+}
+
+
+/*
+ * Keep count of the sessions that are quiet; that is, either finished, or
+ * idle with no replies awaited. Once all of them are, no file taken for
+ * sending is still in use.
+ *
+ */
+
+static VOID set_quiet(PSESSION sp)
+{	BOOL quiet;
+
+	quiet = sp->conn.sockno == -1 ||
+		((sp->phase == PH_IDLE || sp->phase == PH_NOOP) &&
+		 sp->dotwait == FALSE && sp->rsetwait == FALSE) ?
+		TRUE : FALSE;
+	if(quiet != sp->quiet) {
+		sp->quiet = quiet;
+		sp->work->quiet += quiet == TRUE ? 1 : -1;
+	}
 }
 
 
@@ -798,6 +1991,7 @@ static PUCHAR cmdname(STATE state)
 		case ST_MAIL:		return("MAIL command");
 		case ST_RCPT:
 		case ST_RCPT_OR_DATA:	return("RCPT command");
+		case ST_DATA:		return("DATA command");
 		case ST_DATASTART:
 		case ST_TEXT:		return("mail text send");
 
@@ -871,4 +2065,5 @@ static PUCHAR enbase64(PUCHAR in, INT size, PUCHAR out)
  * End of file: client.c
  *
  */
+
 
\ No newline at end of file
@@ -0,0 +1,396 @@
+/*
+ * File: dirscan.c
+ *
+ * Listing of the mail files in a spool directory.
+ *
+ * The directory is read with as few calls on the system as possible; each
+ * call fills a large buffer with as many entries as will fit, rather than
+ * returning just one. The files can be returned in directory order, oldest
+ * first (that is, in the order they were queued) or smallest first.
+ * Directory order tends to follow the layout of the files on the disk; on
+ * HPFS it is also alphabetical order. It is also the only order in which
+ * files can be returned before the whole directory has been read. For the
+ * others, the names are kept in one pool, so that even a very large
+ * directory needs little memory.
+ *
+ * A listing can be restricted to the files written (or created) since a
+ * given time, so that a directory being watched for new mail can be
+ * checked often without returning the same old files every time.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#pragma	strings(readonly)
+
+#define	INCL_DOSDATETIME
+#define	INCL_DOSERRORS
+#define	INCL_DOSFILEMGR
+#define	OS2
+#include <os2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smtp.h"
+#include "dirscan.h"
+
+#define	FINDBUFSIZE	32768		/* Size of directory search buffer */
+#define	FINDCOUNT	4096		/* Most entries asked for at once */
+#define	INITENTS	256		/* Initial room for files */
+#define	INITNAMES	4096		/* Initial size of name pool */
+
+/* Forward references */
+
+static	BOOL		add_entry(PDIRSCAN, PFILEFINDBUF3);
+static	INT		compare(const void *, const void *);
+static	VOID		end_search(PDIRSCAN);
+static	ULONG		file_stamp(PFILEFINDBUF3);
+static	PFILEFINDBUF3	next_entry(PDIRSCAN);
+static	ULONG		stamp(FDATE *, FTIME *);
+
+
+/*
+ * Start listing the files in the directory 'dirname', in the order given
+ * by 'order' (ORDER_xxx). If 'since' is not zero, only files written or
+ * created at or after that time (as returned by 'dirscan_stamp') are
+ * listed. For directory order, the first batch of entries is read now,
+ * and the rest as they are needed; for any other order, the whole
+ * directory has to be read now, and sorted.
+ *
+ * Returns:
+ *	pointer to the context for the listing, to be passed to the other
+ *	routines in this module
+ *	NULL on failure (reported)
+ *
+ */
+
+PDIRSCAN dirscan_open(PUCHAR dirname, INT order, ULONG since)
+{	PDIRSCAN ds;
+	PFILEFINDBUF3 entry;
+	APIRET rc;
+	ULONG count;
+	UCHAR mask[CCHMAXPATH+3];
+
+	ds = (PDIRSCAN) xmalloc(sizeof(DIRSCAN));
+	if(ds == (PDIRSCAN) NULL) return((PDIRSCAN) NULL);
+	memset(ds, 0, sizeof(DIRSCAN));
+	ds->dirname = dirname;
+	ds->order = order;
+	ds->since = since;
+
+	ds->buf = (PUCHAR) xmalloc(FINDBUFSIZE);
+	if(ds->buf == (PUCHAR) NULL) {
+		free(ds);
+		return((PDIRSCAN) NULL);
+	}
+
+#ifdef	DEBUG
+	trace("process_dir : %s\n", dirname);
+#endif
+	strcpy(mask, dirname);
+	strcat(mask, "\\*");		/* Form search mask */
+
+	ds->hdir = HDIR_CREATE;
+	count = FINDCOUNT;
+	rc = DosFindFirst(
+		mask,
+		&ds->hdir,
+		FILE_NORMAL,
+		ds->buf,
+		FINDBUFSIZE,
+		&count,
+		FIL_STANDARD);
+	if(rc == NO_ERROR) {
+		ds->searching = TRUE;
+		ds->entry = (PFILEFINDBUF3) ds->buf;
+		ds->left = count;
+	} else if(rc != ERROR_NO_MORE_FILES) {
+		if(rc == ERROR_PATH_NOT_FOUND)
+			error("directory '%s' does not exist", dirname);
+		else
+			error("DosFindFirst failed, rc = %d", rc);
+		dirscan_close(ds);
+		return((PDIRSCAN) NULL);
+	}
+
+	if(order == ORDER_DIR) return(ds);
+
+	/* If the listing cannot be finished, the files not listed are simply
+	   left for another time */
+
+	for(;;) {
+		entry = next_entry(ds);
+		if(entry == (PFILEFINDBUF3) NULL) break;
+		if(add_entry(ds, entry) == FALSE) break;
+	}
+	end_search(ds);
+
+	qsort(ds->ents, ds->nents, sizeof(SCANENT), compare);
+
+#ifdef	DEBUG
+	trace("%d files found in %s\n", ds->nents, dirname);
+#endif
+
+	return(ds);
+}
+
+
+/*
+ * Get the name of the next file in the listing 'ds', including the name of
+ * the directory, and place it in 'name'. Its size is returned via 'sizep',
+ * and the time it was written or created (see 'dirscan_stamp') via
+ * 'stampp'.
+ *
+ * Returns:
+ *	TRUE		details of next file returned
+ *	FALSE		no more files
+ *
+ */
+
+BOOL dirscan_next(PDIRSCAN ds, PUCHAR name, PULONG sizep, PULONG stampp)
+{	PFILEFINDBUF3 entry;
+	PSCANENT ep;
+
+	if(ds->order == ORDER_DIR) {
+		entry = next_entry(ds);
+		if(entry == (PFILEFINDBUF3) NULL) return(FALSE);
+		sprintf(name, "%s\\%s", ds->dirname, entry->achName);
+		*sizep = entry->cbFile;
+		*stampp = file_stamp(entry);
+		return(TRUE);
+	}
+
+	if(ds->next >= ds->nents) return(FALSE);
+	ep = &ds->ents[ds->next++];
+	sprintf(name, "%s\\%s", ds->dirname, &ds->names[ep->name]);
+	*sizep = ep->size;
+	*stampp = ep->stamp;
+
+	return(TRUE);
+}
+
+
+/*
+ * Discard a listing, and release its context.
+ *
+ */
+
+VOID dirscan_close(PDIRSCAN ds)
+{	if(ds == (PDIRSCAN) NULL) return;
+
+	end_search(ds);
+	if(ds->ents != (PSCANENT) NULL) free(ds->ents);
+	if(ds->names != (PUCHAR) NULL) free(ds->names);
+	free(ds);
+}
+
+
+/*
+ * Return the current date and time, in the form used to restrict a
+ * listing to newer files (see 'dirscan_open').
+ *
+ */
+
+ULONG dirscan_stamp(VOID)
+{	DATETIME dt;
+	FDATE fdate;
+	FTIME ftime;
+
+	(VOID) DosGetDateTime(&dt);
+	fdate.year = dt.year - 1980;
+	fdate.month = dt.month;
+	fdate.day = dt.day;
+	ftime.hours = dt.hours;
+	ftime.minutes = dt.minutes;
+	ftime.twosecs = dt.seconds/2;
+
+	return(stamp(&fdate, &ftime));
+}
+
+
+/*
+ * Get the next entry from the directory search, reading the next batch of
+ * entries when the last one has been used up. Entries for files older
+ * than the time given when the listing was started are skipped.
+ *
+ * Returns:
+ *	pointer to the entry, valid until the next call
+ *	NULL if there are no more entries, or the search failed (reported)
+ *
+ */
+
+static PFILEFINDBUF3 next_entry(PDIRSCAN ds)
+{	PFILEFINDBUF3 entry;
+	APIRET rc;
+	ULONG count;
+
+	for(;;) {
+		if(ds->left == 0) {
+			if(ds->searching == FALSE)
+				return((PFILEFINDBUF3) NULL);
+
+			count = FINDCOUNT;
+			rc = DosFindNext(
+				ds->hdir,
+				ds->buf,
+				FINDBUFSIZE,
+				&count);
+			if(rc != NO_ERROR || count == 0) {
+				if(rc != NO_ERROR && rc != ERROR_NO_MORE_FILES)
+					error("DosFindNext failed, rc = %d",
+						rc);
+				end_search(ds);
+				return((PFILEFINDBUF3) NULL);
+			}
+			ds->entry = (PFILEFINDBUF3) ds->buf;
+			ds->left = count;
+		}
+
+		entry = ds->entry;
+		ds->entry = (PFILEFINDBUF3)
+			((PUCHAR) entry + entry->oNextEntryOffset);
+		ds->left--;
+
+		if(ds->since == 0 || file_stamp(entry) >= ds->since)
+			return(entry);
+	}
+}
+
+
+/*
+ * End the directory search, if it is still going, and release the search
+ * buffer.
+ *
+ */
+
+static VOID end_search(PDIRSCAN ds)
+{	if(ds->searching == TRUE) {
+		(VOID) DosFindClose(ds->hdir);
+		ds->searching = FALSE;
+	}
+	if(ds->buf != (PUCHAR) NULL) {
+		free(ds->buf);
+		ds->buf = (PUCHAR) NULL;
+	}
+	ds->left = 0;
+}
+
+
+/*
+ * Add the file described by 'entry' to the listing, setting its key for
+ * the order of the listing. The tables grow as needed.
+ *
+ * Returns:
+ *	TRUE		file added
+ *	FALSE		out of memory (reported)
+ *
+ */
+
+static BOOL add_entry(PDIRSCAN ds, PFILEFINDBUF3 entry)
+{	PSCANENT ep;
+	PVOID p;
+	ULONG len = entry->cchName + 1;
+	ULONG size;
+
+	if(ds->nents == ds->maxents) {
+		size = ds->maxents == 0 ? INITENTS : ds->maxents*2;
+		p = realloc(ds->ents, size*sizeof(SCANENT));
+		if(p == (PVOID) NULL) {
+			error("cannot allocate memory");
+			return(FALSE);
+		}
+		ds->ents = (PSCANENT) p;
+		ds->maxents = size;
+	}
+
+	if(ds->namelen + len > ds->namemax) {
+		size = ds->namemax == 0 ? INITNAMES : ds->namemax*2;
+		while(ds->namelen + len > size) size *= 2;
+		p = realloc(ds->names, size);
+		if(p == (PVOID) NULL) {
+			error("cannot allocate memory");
+			return(FALSE);
+		}
+		ds->names = (PUCHAR) p;
+		ds->namemax = size;
+	}
+
+	ep = &ds->ents[ds->nents];
+	switch(ds->order) {
+		case ORDER_TIME:	/* Oldest first */
+			ep->key = stamp(&entry->fdateLastWrite,
+					&entry->ftimeLastWrite);
+			break;
+
+		case ORDER_SIZE:	/* Smallest first */
+			ep->key = entry->cbFile;
+			break;
+
+		default:		/* Directory order */
+			ep->key = 0;
+			break;
+	}
+	ep->seq = ds->nents;
+	ep->size = entry->cbFile;
+	ep->stamp = file_stamp(entry);
+	ep->name = ds->namelen;
+	memcpy(&ds->names[ds->namelen], entry->achName, len);
+	ds->namelen += len;
+	ds->nents++;
+
+	return(TRUE);
+}
+
+
+/*
+ * Return the time a file was written or created, whichever is the later;
+ * a file copied into the directory keeps its old write time. The creation
+ * time is zero if the file system does not record it.
+ *
+ */
+
+static ULONG file_stamp(PFILEFINDBUF3 entry)
+{	ULONG created, written;
+
+	created = stamp(&entry->fdateCreation, &entry->ftimeCreation);
+	written = stamp(&entry->fdateLastWrite, &entry->ftimeLastWrite);
+
+	return(created > written ? created : written);
+}
+
+
+/*
+ * Combine a file date and time into a single value, which increases with
+ * time; it has a resolution of two seconds.
+ *
+ */
+
+static ULONG stamp(FDATE *fdate, FTIME *ftime)
+{	return(((ULONG) *(PUSHORT) fdate << 16) | *(PUSHORT) ftime);
+}
+
+
+/*
+ * Compare two files, for 'qsort'. Files with the same key stay in
+ * directory order.
+ *
+ */
+
+static INT compare(const void *a, const void *b)
+{	PSCANENT pa = (PSCANENT) a;
+	PSCANENT pb = (PSCANENT) b;
+
+	if(pa->key != pb->key) return(pa->key < pb->key ? -1 : 1);
+	if(pa->seq != pb->seq) return(pa->seq < pb->seq ? -1 : 1);
+
+	return(0);
+}
+
+/*
+ * End of file: dirscan.c
+ *
+ */
+
+
\ No newline at end of file
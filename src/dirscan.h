@@ -0,0 +1,51 @@
+/*
+ * File: dirscan.h
+ *
+ * Listing of the mail files in a spool directory; header file.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+/* Structure definitions */
+
+typedef struct _SCANENT {		/* One file in the directory */
+ULONG		key;			/* Key for ordering (see dirscan.c) */
+ULONG		seq;			/* Position in the directory */
+ULONG		size;			/* Size of the file */
+ULONG		stamp;			/* Time file written or created */
+ULONG		name;			/* Offset of name in name pool */
+} SCANENT, *PSCANENT;
+
+typedef struct _DIRSCAN {		/* Directory being listed */
+PUCHAR		dirname;		/* Name of the directory */
+INT		order;			/* Order of listing (ORDER_xxx) */
+ULONG		since;			/* Only files written since this
+					   time (see dirscan_stamp), or 0 */
+HDIR		hdir;			/* Directory search handle */
+BOOL		searching;		/* TRUE while search is open */
+PUCHAR		buf;			/* Search buffer */
+PFILEFINDBUF3	entry;			/* Next entry in search buffer */
+ULONG		left;			/* Entries left in search buffer */
+PSCANENT	ents;			/* Sorted list of files */
+INT		nents;			/* Number of files */
+INT		maxents;		/* Room in 'ents' */
+PUCHAR		names;			/* Pool of file names */
+ULONG		namelen;		/* Bytes used in name pool */
+ULONG		namemax;		/* Size of name pool */
+INT		next;			/* Next file to be returned */
+} DIRSCAN, *PDIRSCAN;
+
+/* External references */
+
+extern	VOID		dirscan_close(PDIRSCAN);
+extern	BOOL		dirscan_next(PDIRSCAN, PUCHAR, PULONG, PULONG);
+extern	PDIRSCAN	dirscan_open(PUCHAR, INT, ULONG);
+extern	ULONG		dirscan_stamp(VOID);
+
+/*
+ * End of file: dirscan.h
+ *
+ */
+
+
\ No newline at end of file
@@ -0,0 +1,157 @@
+/*
+ * File: engine.c
+ *
+ * Event loop for driving many network connections concurrently.
+ *
+ * Each connection is described by a CONN structure, which says which
+ * events are of interest and when the connection should time out. The
+ * loop waits for any connection to become ready (using 'select'), and
+ * calls the connection's handler for each event. There are no blocking
+ * operations, so one thread can drive any number of SMTP sessions.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#pragma	strings(readonly)
+
+#define	INCL_DOSMISC
+#define	OS2
+#include <os2.h>
+
+#include <stdlib.h>
+#include <types.h>
+#include <sys\socket.h>
+#include <nerrno.h>
+
+#include "smtp.h"
+#include "engine.h"
+
+
+/*
+ * Return the current time, in milliseconds. This wraps after about 49
+ * days, so times should only be compared by subtraction.
+ *
+ */
+
+ULONG engine_now(VOID)
+{	ULONG ms;
+
+	(VOID) DosQuerySysInfo(QSV_MS_COUNT, QSV_MS_COUNT, &ms, sizeof(ms));
+
+	return(ms);
+}
+
+
+/*
+ * Run the event loop for the 'n' connections in 'conns', until every one
+ * of them has finished (its socket set to -1). A connection whose
+ * deadline passes is given an EV_TIMEOUT event; it should then finish, or
+ * set a new deadline.
+ *
+ * Returns:
+ *	TRUE		all connections finished
+ *	FALSE		the event loop itself failed
+ *
+ */
+
+BOOL engine_run(PCONN *conns, INT n)
+{	INT i, nread, nwrite, active, rc;
+	LONG wait, left;
+	ULONG now;
+	PCONN cp;
+	PINT sockset;			/* Sockets for 'select' */
+	PINT index;			/* Connection for each socket */
+
+	sockset = (PINT) xmalloc(2*n*sizeof(INT));
+	index = (PINT) xmalloc(2*n*sizeof(INT));
+	if(sockset == (PINT) NULL || index == (PINT) NULL) {
+		if(sockset != (PINT) NULL) free(sockset);
+		if(index != (PINT) NULL) free(index);
+		return(FALSE);
+	}
+
+	for(;;) {
+		/* Build the list of sockets to wait for; readers first,
+		   then writers, as 'select' requires. Also work out how long
+		   to wait before the nearest deadline. */
+
+		active = 0;
+		nread = nwrite = 0;
+		wait = -1;		/* Indefinitely */
+		now = engine_now();
+
+		for(i = 0; i < n; i++) {
+			cp = conns[i];
+			if(cp->sockno == -1) continue;
+			active++;
+			if(cp->events & EV_READ) {
+				index[nread] = i;
+				sockset[nread++] = cp->sockno;
+			}
+			if(cp->deadline != 0) {
+				left = (LONG) (cp->deadline - now);
+				if(left < 0) left = 0;
+				if(wait == -1 || left < wait) wait = left;
+			}
+		}
+		for(i = 0; i < n; i++) {
+			cp = conns[i];
+			if(cp->sockno == -1) continue;
+			if(cp->events & EV_WRITE) {
+				index[nread+nwrite] = i;
+				sockset[nread+nwrite++] = cp->sockno;
+			}
+		}
+
+		if(active == 0) break;	/* All finished */
+
+		rc = select(sockset, nread, nwrite, 0, wait);
+		if(rc < 0) {
+			if(sock_errno() == SOCEINTR) continue;
+			error("select failed, error %d", sock_errno());
+			free(sockset);
+			free(index);
+			return(FALSE);
+		}
+
+		/* Dispatch events. A handler may finish its connection, or
+		   change the events it is interested in, so check before
+		   each call. */
+
+		for(i = 0; i < nread+nwrite; i++) {
+			if(sockset[i] == -1) continue;
+			cp = conns[index[i]];
+			if(cp->sockno == -1) continue;
+			if(i < nread) {
+				if(cp->events & EV_READ)
+					(*cp->handler)(cp, EV_READ);
+			} else {
+				if(cp->events & EV_WRITE)
+					(*cp->handler)(cp, EV_WRITE);
+			}
+		}
+
+		/* Now deal with any connections whose time is up */
+
+		now = engine_now();
+		for(i = 0; i < n; i++) {
+			cp = conns[i];
+			if(cp->sockno == -1 || cp->deadline == 0) continue;
+			if((LONG) (now - cp->deadline) >= 0)
+				(*cp->handler)(cp, EV_TIMEOUT);
+		}
+	}
+
+	free(sockset);
+	free(index);
+
+	return(TRUE);
+}
+
+/*
+ * End of file: engine.c
+ *
+ */
+
+
\ No newline at end of file
@@ -0,0 +1,40 @@
+/*
+ * File: engine.h
+ *
+ * Event loop for driving many network connections concurrently;
+ * header file.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+/* Event codes, passed to a connection's handler */
+
+#define	EV_READ			0x01	/* Socket is readable */
+#define	EV_WRITE		0x02	/* Socket is writable */
+#define	EV_TIMEOUT		0x04	/* Connection's deadline has passed */
+
+/* Structure definitions */
+
+typedef struct _CONN {			/* A connection driven by the engine */
+INT		sockno;			/* Socket, or -1 when finished */
+INT		events;			/* Events of interest (EV_READ and/or
+					   EV_WRITE) */
+ULONG		deadline;		/* Time (from 'engine_now') by which
+					   something must happen; 0 if none */
+VOID		(*handler)(struct _CONN *, INT);
+					/* Called when events occur */
+PVOID		data;			/* For use by owner of connection */
+} CONN, *PCONN;
+
+/* External references */
+
+extern	ULONG	engine_now(VOID);
+extern	BOOL	engine_run(PCONN *, INT);
+
+/*
+ * End of file: engine.h
+ *
+ */
+
+
\ No newline at end of file
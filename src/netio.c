@@ -1,7 +1,7 @@
 /*
  * File: netio.c
  *
- * General network I/O and timeout routines.
+ * General nonblocking network I/O routines.
  *
  * Bob Eager   December 2004
  *
@@ -9,7 +9,7 @@
 
 #pragma	strings(readonly)
 
-#pragma	alloc_text(a_init_seg, netio_init)
+#pragma	alloc_text(a_init_seg, netio_open)
 
 #define	OS2
 #include <os2.h>
@@ -18,85 +18,211 @@
 #include <string.h>
 #include <types.h>
 #include <sys\socket.h>
+#include <sys\ioctl.h>
 #include <nerrno.h>
+#ifdef	TLS
+#include <openssl\ssl.h>
+#endif
 
 #include "netio.h"
 
-#define	BUFSIZE		1024		/* Size of network input buffer */
+#define	DEFBUFSIZE	16384		/* Default size of network input
+					   buffer */
 
 /* Forward references */
 
-static	INT	fill_buffer(INT, INT);
-static	INT	sock_send(INT, PUCHAR, INT, INT);
+static	VOID	buffer_out(PNETIO, PUCHAR, INT);
+static	INT	sock_send(PNETIO, PUCHAR, INT);
+#ifdef	TLS
+static	INT	tls_read(PNETIO);
+static	INT	tls_send(PNETIO, PUCHAR, INT);
+#endif
 
-/* Local storage */
 
-static	INT	count;			/* Bytes remaining in input buffer */
-static	INT	next;			/* Offset of next byte in input buffer */
-static	UCHAR	buf[BUFSIZE];		/* Network input buffer */
+/*
+ * Set up buffering, etc. for a connection on socket 'sockno', and put
+ * the socket into nonblocking mode. The size of the network input buffer
+ * may be specified; zero selects the default. This is also the longest
+ * line that 'sock_getline' can return.
+ *
+ * Returns:
+ *	pointer to the connection context, to be passed to the other
+ *	routines in this module
+ *	NULL on failure
+ *
+ */
+
+PNETIO netio_open(INT sockno, INT size)
+{	PNETIO np;
+	INT dontblock = 1;
+
+	if(size <= 0) size = DEFBUFSIZE;
+
+	if(ioctl(sockno, FIONBIO, (PCHAR) &dontblock, sizeof(dontblock)) < 0)
+		return((PNETIO) NULL);
+
+	np = (PNETIO) malloc(sizeof(NETIO));
+	if(np == (PNETIO) NULL) return((PNETIO) NULL);
+	memset(np, 0, sizeof(NETIO));
+
+	np->buf = (PUCHAR) malloc(size+1);	/* Room for terminator */
+	if(np->buf == (PUCHAR) NULL) {
+		free(np);
+		return((PNETIO) NULL);
+	}
+	np->bufsize = size;
+	np->obuf = (PUCHAR) malloc(OBUFSIZE);
+	if(np->obuf == (PUCHAR) NULL) {
+		free(np->buf);
+		free(np);
+		return((PNETIO) NULL);
+	}
+	np->osize = OBUFSIZE;
+	np->sockno = sockno;
+	np->held = -1;
+
+	return(np);
+}
+
+
+/*
+ * Release a connection context. The socket itself is not closed, but
+ * any TLS connection on it is discarded. It is marked as shut down
+ * first; otherwise OpenSSL would mark its session as not resumable, and
+ * the session cache (see tls.c) would be of no use to later connections.
+ *
+ */
+
+VOID netio_close(PNETIO np)
+{	if(np == (PNETIO) NULL) return;
+
+#ifdef	TLS
+	if(np->tls != (PVOID) NULL) {
+		SSL_set_shutdown(
+			(SSL *) np->tls,
+			SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		SSL_free((SSL *) np->tls);
+	}
+#endif
+	free(np->obuf);
+	free(np->buf);
+	free(np);
+}
 
 
 /*
- * Initialise buffering, etc.
+ * Read whatever data is available from the socket into the network input
+ * buffer. This should be called when the socket is known to be readable.
+ *
  * Returns:
- *	TRUE		success
- *	FALSE		failure
+ *	> 0			number of bytes read
+ *	SOCKIO_AGAIN		no data available
+ *	SOCKIO_WANTWRITE	(TLS only) wait until the socket is writable,
+ *				then call again
+ *	SOCKIO_ERR		nonspecific network read error, or connection
+ *				closed
  *
  */
 
-BOOL netio_init(VOID)
-{	/* Initialise count of bytes in network input buffer */
+INT sock_read(PNETIO np)
+{	INT len;
+
+	if(np->held >= 0) {		/* Restore character after last line */
+		np->buf[np->held] = np->heldc;
+		np->held = -1;
+	}
+
+	if(np->count == 0 || np->next + np->count == np->bufsize) {
+		memmove(np->buf, &np->buf[np->next], np->count);
+		np->next = 0;		/* Make room */
+	}
 
-	count = 0;
+#ifdef	TLS
+	if(np->tls != (PVOID) NULL) return(tls_read(np));
+#endif
 
-	return(TRUE);
+	len = recv(
+		np->sockno,
+		&np->buf[np->next+np->count],
+		np->bufsize-(np->next+np->count),
+		0);
+	if(len < 0 && sock_errno() == SOCEWOULDBLOCK) return(SOCKIO_AGAIN);
+	if(len <= 0) return(SOCKIO_ERR);
+
+	np->count += len;
+
+	return(len);
 }
 
 
 /*
- * Get a line from a socket. Carriage return, linefeed sequence is replaced
- * by a linefeed.
+ * Get the next complete line from the network input buffer, without
+ * copying it. A pointer to the line, which is left in the buffer, is
+ * returned via 'linep'. Carriage return, linefeed sequence is replaced by
+ * a linefeed, and the line is null terminated. The line remains valid
+ * only until the next call on this module for the same connection.
+ *
+ * The buffer is searched for a line end a block at a time, rather than
+ * a character at a time; data already searched is not searched again when
+ * more arrives.
  *
  * Returns:
- *	>= 0			length of line read
+ *	>= 0			length of line
+ *	SOCKIO_AGAIN		no complete line yet; call 'sock_read'
  *	SOCKIO_TOOLONG		line too long for buffer; rest of line absorbed
- *	SOCKIO_TIMEOUT		input timed out
- *	SOCKIO_ERR		nonspecific network read error
  *
  */
 
-INT sock_gets(PUCHAR line, INT size, INT sockno, INT timeout)
-{	INT len = 0;
-	UCHAR c;
-	BOOL full = FALSE;
+INT sock_getline(PNETIO np, PUCHAR *linep)
+{	INT len;
+	PUCHAR start, end;
 
-	for(;;) {
-		if(count == 0) count = fill_buffer(sockno, timeout);
-		if(count == 0) return(SOCKIO_ERR);
-		if(count < 0) return(SOCKIO_TIMEOUT);
-
-		c = buf[next++];
-		count--;
-		if(c == '\r') {
-			if(count == 0) count = fill_buffer(sockno, timeout);
-			if(count == 0) return(SOCKIO_ERR);
-			if(count < 0) return(SOCKIO_TIMEOUT);
-
-			if(buf[next] == '\n') {
-				next++;
-				count--;
-				if(full == FALSE) line[len++] = '\n';
-				break;
-			}
+	if(np->held >= 0) {		/* Restore character after last line */
+		np->buf[np->held] = np->heldc;
+		np->held = -1;
+	}
+
+	start = &np->buf[np->next];
+	end = (PUCHAR) memchr(
+			start+np->scanned,
+			'\n',
+			np->count-np->scanned);
+	if(end == (PUCHAR) NULL) {
+		np->scanned = np->count;
+		if(np->count == np->bufsize) {
+			/* No line end in full buffer */
+			np->discard = TRUE;	/* Absorb rest of line */
+			np->count = 0;
+			np->next = 0;
+			np->scanned = 0;
 		}
-		if(full == FALSE) line[len++] = c;
-		if(len == size - 1) full = TRUE;
-		if(c == '\n') break;
+		return(SOCKIO_AGAIN);
+	}
+
+	len = end - start + 1;		/* Including the linefeed */
+	np->next += len;
+	np->count -= len;
+	np->scanned = 0;
+
+	if(np->discard == TRUE) {
+		np->discard = FALSE;
+		*linep = (PUCHAR) "";
+		return(SOCKIO_TOOLONG);
 	}
-	
-	line[len] = '\0';
 
-	return(full ? SOCKIO_TOOLONG : len);
+	if(len > 1 && end[-1] == '\r') {
+		end--;			/* Replace CR LF by LF */
+		end[0] = '\n';
+		len--;
+	}
+
+	np->held = (end + 1) - np->buf;	/* Terminate line in place */
+	np->heldc = end[1];
+	end[1] = '\0';
+
+	*linep = start;
+
+	return(len);
 }
 
 
@@ -104,80 +230,408 @@ INT sock_gets(PUCHAR line, INT size, INT sockno, INT timeout)
  * Send a line to a socket. Massages a terminating linefeed (\n)
  * into carriage return followed by linefeed.
  *
+ * The line is not sent immediately, but is added to the output buffer;
+ * the buffer is sent when it fills, or when 'sock_flush' is called.
+ * This never waits; if the socket cannot take any more, the buffer is
+ * enlarged instead. Callers should use 'sock_room' to avoid overfilling
+ * the buffer, so that this happens rarely, if at all.
+ *
  */
 
-VOID sock_puts(PUCHAR line, INT sockno, INT timeout)
+VOID sock_puts(PNETIO np, PUCHAR line)
 {	static const UCHAR crlf[] = "\r\n";
 	INT len = strlen(line);
 
 	if(line[len-1] == '\n') {
 		len--;
-		sock_send(sockno, line, len, timeout);
+		buffer_out(np, line, len);
+		np->out_unbuffered++;
 		len = strlen(crlf);
 		line = (PUCHAR) &crlf[0];
 	}
-	sock_send(sockno, line, len, timeout);
+	buffer_out(np, line, len);
+	np->out_unbuffered++;
 }
 
 
 /*
- * Refill the network input buffer.
+ * Send as much as possible of the data waiting in the output buffer,
+ * without blocking.
  *
  * Returns:
- *	>0		number of bytes in buffer
- *	0		nonspecific network read error
- *	<0		timeout
+ *	0			all data sent
+ *	SOCKIO_AGAIN		some data remains; wait until socket writable
+ *	SOCKIO_ERR		nonspecific network write error (this, or any
+ *				earlier, write failed)
  *
  */
 
-static INT fill_buffer(INT sockno, INT timeout)
+INT sock_flush(PNETIO np)
 {	INT rc;
-	INT len;
-	INT sockset[2];
 
-	next = 0;			/* Reset buffer pointer */
+	if(np->oerror == TRUE) return(SOCKIO_ERR);
 
-	/* Set up and perform select call */
+	if(np->ocount > np->ostart) {
+		rc = sock_send(np, &np->obuf[np->ostart],
+				np->ocount - np->ostart);
+		if(rc < 0) {
+			np->oerror = TRUE;
+			return(SOCKIO_ERR);
+		}
+		np->ostart += rc;
+	}
 
-	sockset[0] = sockno;		/* Read waiting */
-	sockset[1] = sockno;		/* Exception */
+	if(np->ostart == np->ocount) {
+		np->ostart = np->ocount = 0;
+		return(0);
+	}
 
-	rc = select(
-		sockset,		/* List of sockets */
-		1,			/* Sockets for read check */
-		0,			/* Sockets for write check */
-		1,			/* Sockets for exception check */
-		timeout*1000);		/* Timeout period */
+	return(SOCKIO_AGAIN);
+}
 
-	if(rc == 0) return(-1);		/* Timeout expired */
-	if(rc < 0) return(0);		/* Error */
 
-	if(sockset[1] != -1)		/* Exception on socket */
-		return(0);
+/*
+ * Return the number of bytes waiting to be sent.
+ *
+ */
+
+INT sock_pending(PNETIO np)
+{	return(np->ocount - np->ostart);
+}
+
+
+/*
+ * Return the number of bytes that may be added to the output buffer
+ * without it having to be sent.
+ *
+ */
 
-	if(sockset[0] != -1) {	/* Read ready */
-		len = recv(sockno, buf, BUFSIZE, 0);
-		return(len);
+INT sock_room(PNETIO np)
+{	if(np->ostart != 0) {		/* Move unsent data to the front */
+		memmove(np->obuf, &np->obuf[np->ostart],
+				np->ocount - np->ostart);
+		np->ocount -= np->ostart;
+		np->ostart = 0;
 	}
 
-	return(0);			/* Some other problem */
+	return(np->osize - np->ocount);
+}
+
+
+/*
+ * Return a pointer to the free space at the end of the output buffer, so
+ * that data can be placed there directly instead of being copied in. The
+ * amount of space is given by 'sock_room', which must be called first.
+ *
+ */
+
+PUCHAR sock_space(PNETIO np)
+{	return(&np->obuf[np->ocount]);
+}
+
+
+/*
+ * Add 'len' bytes, already placed in the output buffer by the caller
+ * (see 'sock_space'), to the data waiting to be sent.
+ *
+ */
+
+VOID sock_commit(PNETIO np, INT len)
+{	np->ocount += len;
+	np->out_unbuffered++;
+}
+
+
+#ifdef	TLS
+/*
+ * Start using TLS on the connection, with the TLS connection structure
+ * 'tls' (an SSL *, which is freed when the connection is closed). Any
+ * buffered input, which was sent before the TLS session started, is
+ * discarded. The caller should then call 'sock_handshake' until the
+ * handshake is complete; after that, all I/O is encrypted.
+ *
+ */
+
+VOID sock_starttls(PNETIO np, PVOID tls)
+{	SSL *ssl = (SSL *) tls;
+
+	np->count = np->next = np->scanned = 0;
+	np->discard = FALSE;
+	np->held = -1;
+
+	(VOID) SSL_set_fd(ssl, np->sockno);
+	SSL_set_connect_state(ssl);
+	SSL_set_mode(
+		ssl,
+		SSL_MODE_ENABLE_PARTIAL_WRITE |
+		SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	np->tls = tls;
 }
 
 
 /*
- * Write a buffer to a socket.
+ * Advance the TLS handshake as far as possible without blocking.
  *
  * Returns:
- *	same as for 'send'
+ *	0			handshake complete
+ *	SOCKIO_WANTREAD		wait until the socket is readable, then call
+ *				again
+ *	SOCKIO_WANTWRITE	wait until the socket is writable, then call
+ *				again
+ *	SOCKIO_ERR		handshake failed
  *
  */
 
-static INT sock_send(INT sockno, PUCHAR buf, INT len, INT timeout)
-{	return(send(sockno, buf, len, 0));
+INT sock_handshake(PNETIO np)
+{	INT rc;
+
+	rc = SSL_do_handshake((SSL *) np->tls);
+	if(rc == 1) return(0);
+
+	switch(SSL_get_error((SSL *) np->tls, rc)) {
+		case SSL_ERROR_WANT_READ:
+			return(SOCKIO_WANTREAD);
+
+		case SSL_ERROR_WANT_WRITE:
+			return(SOCKIO_WANTWRITE);
+
+		default:
+			return(SOCKIO_ERR);
+	}
+}
+#endif
+
+
+/*
+ * Send a block of data, straight from the caller's buffer if it is large.
+ * A block that fits in the free space in the output buffer is simply
+ * added to it, as by 'sock_puts'. Otherwise, the output buffer is topped
+ * up from the data (so that what is waiting still goes out in full sized
+ * segments) and sent, and if it empties the rest of the data is sent
+ * directly, rather than being copied. As much is sent as the socket will
+ * accept without blocking.
+ *
+ * Over TLS, data that has been offered and not taken may already be in
+ * the TLS layer; the caller must offer it again, from the same point,
+ * before sending anything else.
+ *
+ * Returns:
+ *	>= 0			number of bytes taken (possibly zero); to send
+ *				the rest, wait until the socket is writable
+ *	SOCKIO_ERR		nonspecific network write error (this, or any
+ *				earlier, write failed)
+ *
+ */
+
+INT sock_write(PNETIO np, PUCHAR data, INT len)
+{	INT n, rc;
+	INT taken = 0;
+
+	if(np->oerror == TRUE) return(SOCKIO_ERR);
+
+	n = sock_room(np);
+	if(len < n || np->ocount > np->ostart) {
+		if(n > len) n = len;
+		memcpy(&np->obuf[np->ocount], data, n);
+		np->ocount += n;
+		np->out_unbuffered++;
+		taken = n;
+		if(taken == len && np->ocount < np->osize) return(taken);
+
+		rc = sock_flush(np);
+		if(rc == SOCKIO_ERR) return(SOCKIO_ERR);
+		if(rc == SOCKIO_AGAIN || taken == len) return(taken);
+	}
+
+	rc = sock_send(np, data+taken, len-taken);
+	if(rc < 0) {
+		np->oerror = TRUE;
+		return(SOCKIO_ERR);
+	}
+	np->out_unbuffered++;
+
+	return(taken+rc);
+}
+
+
+/*
+ * Return output statistics: the number of bytes sent, the number of
+ * 'send' calls actually made, and the number that were saved by buffering.
+ *
+ */
+
+VOID netio_stats(PNETIO np, PULONG bytes, PULONG sends, PULONG saved)
+{	*bytes = np->out_bytes;
+	*sends = np->out_sends;
+	*saved = np->out_unbuffered > np->out_sends ?
+			np->out_unbuffered - np->out_sends : 0;
+}
+
+
+/*
+ * Add data to the output buffer, sending the buffer each time it fills.
+ * If the socket cannot accept any more, enlarge the buffer rather than
+ * wait; the data goes when the caller next flushes the buffer.
+ *
+ */
+
+static VOID buffer_out(PNETIO np, PUCHAR data, INT len)
+{	INT n;
+	PUCHAR p;
+
+	if(np->oerror == TRUE) return;	/* Earlier failure; discard */
+
+	while(len > 0) {
+		n = sock_room(np);
+		if(n == 0) {
+			if(sock_flush(np) == SOCKIO_ERR) return;
+			n = sock_room(np);
+		}
+		if(n == 0) {
+			p = (PUCHAR) realloc(np->obuf, np->osize + len);
+			if(p == (PUCHAR) NULL) {
+				np->oerror = TRUE;
+				return;
+			}
+			np->obuf = p;
+			np->osize += len;
+			n = len;
+		}
+
+		if(n > len) n = len;
+		memcpy(&np->obuf[np->ocount], data, n);
+		np->ocount += n;
+		data += n;
+		len -= n;
+	}
 }
 
+
+/*
+ * Write a buffer to a socket, without blocking.
+ *
+ * Returns:
+ *	number of bytes sent, possibly zero
+ *	SOCKIO_ERR on error
+ *
+ */
+
+static INT sock_send(PNETIO np, PUCHAR buf, INT len)
+{	INT rc;
+	INT sent = 0;
+
+#ifdef	TLS
+	if(np->tls != (PVOID) NULL) return(tls_send(np, buf, len));
+#endif
+
+	while(sent < len) {
+		rc = send(np->sockno, buf+sent, len-sent, 0);
+		np->out_sends++;
+		if(rc < 0) {
+			if(sock_errno() == SOCEWOULDBLOCK) break;
+			return(SOCKIO_ERR);
+		}
+		if(rc == 0) break;
+		sent += rc;
+	}
+	np->out_bytes += sent;
+
+	return(sent);
+}
+
+#ifdef	TLS
+/*
+ * Read whatever data is available from a TLS connection into the network
+ * input buffer; the equivalent of 'recv' for 'sock_read'. Decrypted data
+ * may be held inside the TLS layer, so this reads until that is empty
+ * or the buffer is full. The TLS layer may also need to send something
+ * before it can read any more; if the socket cannot take it yet, the
+ * caller must wait until it can, rather than until it is readable.
+ *
+ * Returns:
+ *	> 0			number of bytes read
+ *	SOCKIO_AGAIN		no data available
+ *	SOCKIO_WANTWRITE	wait until the socket is writable, then call
+ *				again; any data read is already in the buffer
+ *	SOCKIO_ERR		nonspecific network read error, or connection
+ *				closed
+ *
+ */
+
+static INT tls_read(PNETIO np)
+{	INT rc, room;
+	INT len = 0;
+	SSL *ssl = (SSL *) np->tls;
+
+	for(;;) {
+		room = np->bufsize-(np->next+np->count);
+		if(room == 0) break;
+
+		rc = SSL_read(ssl, &np->buf[np->next+np->count], room);
+		if(rc > 0) {
+			np->count += rc;
+			len += rc;
+			continue;
+		}
+
+		switch(SSL_get_error(ssl, rc)) {
+			case SSL_ERROR_WANT_READ:
+				break;
+
+			case SSL_ERROR_WANT_WRITE:
+				return(SOCKIO_WANTWRITE);
+
+			default:
+				if(len == 0) return(SOCKIO_ERR);
+				break;
+		}
+		break;
+	}
+
+	return(len == 0 ? SOCKIO_AGAIN : len);
+}
+
+
+/*
+ * Write a buffer to a TLS connection, without blocking; the equivalent
+ * of the 'send' loop in 'sock_send'.
+ *
+ * Returns:
+ *	number of bytes sent, possibly zero
+ *	SOCKIO_ERR on error
+ *
+ */
+
+static INT tls_send(PNETIO np, PUCHAR buf, INT len)
+{	INT rc;
+	INT sent = 0;
+	SSL *ssl = (SSL *) np->tls;
+
+	while(sent < len) {
+		rc = SSL_write(ssl, buf+sent, len-sent);
+		np->out_sends++;
+		if(rc <= 0) {
+			switch(SSL_get_error(ssl, rc)) {
+				case SSL_ERROR_WANT_READ:
+				case SSL_ERROR_WANT_WRITE:
+					break;
+
+				default:
+					return(SOCKIO_ERR);
+			}
+			break;
+		}
+		sent += rc;
+	}
+	np->out_bytes += sent;
+
+	return(sent);
+}
+#endif
+
 /*
  * End of file: netio.c
  *
  */
+
 
\ No newline at end of file
@@ -1,7 +1,7 @@
 /*
  * File: netio.h
  *
- * General network I/O and timeout routines; header file.
+ * General nonblocking network I/O routines; header file.
  *
  * Bob Eager   December 2004
  *
@@ -12,15 +12,67 @@
 
 /* Error codes */
 
-#define	SOCKIO_TOOLONG		-1	/* Line too long from sock_gets() */
-#define	SOCKIO_TIMEOUT		-2	/* Timeout on sock_gets()/sock_puts() */
+#define	SOCKIO_TOOLONG		-1	/* Line too long from sock_getline() */
 #define	SOCKIO_ERR		-3	/* Nonspecific socket I/O error */
+#define	SOCKIO_AGAIN		-4	/* Operation would block */
+#define	SOCKIO_WANTREAD		-5	/* TLS handshake needs to read */
+#define	SOCKIO_WANTWRITE	-6	/* TLS handshake needs to write */
+
+/* Tunable constants */
+
+#define	OBUFSIZE	8760		/* Initial size of network output
+					   buffer; a multiple of the
+					   usual Ethernet MSS (1460) so
+					   that full segments go out */
+
+/* Structure definitions */
+
+typedef struct _NETIO {			/* Per-connection I/O context */
+INT		sockno;			/* Socket for this connection */
+INT		count;			/* Bytes remaining in input buffer */
+INT		next;			/* Offset of next byte in input
+					   buffer */
+INT		scanned;		/* Bytes at 'next' already searched
+					   for a line end */
+BOOL		discard;		/* TRUE if absorbing an overlong line */
+INT		bufsize;		/* Size of network input buffer */
+PUCHAR		buf;			/* Network input buffer */
+INT		held;			/* Offset of character overwritten by
+					   terminator of last line returned */
+UCHAR		heldc;			/* The overwritten character itself */
+PVOID		tls;			/* TLS connection, or NULL */
+INT		ostart;			/* Offset of first unsent byte in
+					   output buffer */
+INT		ocount;			/* End of data in output buffer */
+BOOL		oerror;			/* TRUE if a write has failed */
+ULONG		out_bytes;		/* Total bytes sent */
+ULONG		out_sends;		/* Number of 'send' calls made */
+ULONG		out_unbuffered;		/* 'send' calls that unbuffered
+					   output would have needed */
+INT		osize;			/* Size of output buffer */
+PUCHAR		obuf;			/* Network output buffer */
+} NETIO, *PNETIO;
 
 /* Network I/O functions */
 
-extern	BOOL	netio_init(VOID);
-extern	INT	sock_gets(PUCHAR, INT, INT, INT);
-extern	VOID	sock_puts(PUCHAR, INT, INT);
+extern	VOID	netio_close(PNETIO);
+extern	PNETIO	netio_open(INT, INT);
+extern	VOID	netio_stats(PNETIO, PULONG, PULONG, PULONG);
+extern	VOID	sock_commit(PNETIO, INT);
+extern	INT	sock_flush(PNETIO);
+extern	INT	sock_getline(PNETIO, PUCHAR *);
+#ifdef	TLS
+extern	INT	sock_handshake(PNETIO);
+#endif
+extern	INT	sock_pending(PNETIO);
+extern	VOID	sock_puts(PNETIO, PUCHAR);
+extern	INT	sock_read(PNETIO);
+extern	INT	sock_room(PNETIO);
+extern	PUCHAR	sock_space(PNETIO);
+extern	INT	sock_write(PNETIO, PUCHAR, INT);
+#ifdef	TLS
+extern	VOID	sock_starttls(PNETIO, PVOID);
+#endif
 
 /*
  * End of file: netio.h
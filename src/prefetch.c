@@ -0,0 +1,712 @@
+/*
+ * File: prefetch.c
+ *
+ * Read-ahead of the mail files to be sent.
+ *
+ * The sessions (see client.c) are all driven by one thread, which should
+ * not wait for anything but the network. Finding the next mail file,
+ * opening it and reading it all take time, which would otherwise be added
+ * to the time spent waiting for the server. So a second thread works
+ * through the list of files and directories (see dirscan.c), opening each
+ * mail file in turn and reading its first block (see spool.c); the file
+ * is then queued, ready for the next session that wants one. The queue
+ * has a fixed number of places, which limits the number of files open, and
+ * the memory used for them; when it is full, the thread waits until a
+ * file is taken.
+ *
+ * The thread is started before the connections to the server are made,
+ * so that the search for files goes on while they are being made. The
+ * list is searched only once; the check for there being anything to send
+ * at all just waits for the first file to be queued.
+ *
+ * When the program runs as a daemon (the -w option), the list is searched
+ * again every POLLTIME. These searches only look for files written since
+ * the last one started; file times are only recorded to two seconds, so
+ * the names of the newest files returned by each search are also kept,
+ * and those files are not returned again by the next one. So no file is
+ * ever returned twice, even while it is still being sent. A file that was
+ * listed but skipped (because it could not be claimed, say) is not kept,
+ * so that the next search tries it again. Every so often there is a full
+ * search instead, to retry the files that could not be sent, and to find
+ * files that were moved into the directories with their old times. While
+ * files returned are still in use, that is only done if every file is
+ * claimed before it is sent, so that those files are not found by it. A
+ * full search is also made as soon as one of the files that could not be
+ * sent is due to be tried again, according to the queue index (see
+ * qindex.c). Files that are not yet due are skipped without being
+ * opened.
+ *
+ * Each file is claimed before it is opened (see claim.c), so that it is not
+ * also sent by another copy of the program using the same spool
+ * directories; a file that has already been claimed is skipped.
+ *
+ * If the thread cannot be started, the same work is done as each file is
+ * wanted.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#pragma	strings(readonly)
+
+#pragma	alloc_text(a_init_seg, prefetch_start)
+
+#define	INCL_DOSERRORS
+#define	INCL_DOSFILEMGR
+#define	INCL_DOSPROCESS
+#define	INCL_DOSSEMAPHORES
+#define	OS2
+#include <os2.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtp.h"
+#include "spool.h"
+#include "dirscan.h"
+#include "engine.h"
+#include "qindex.h"
+#include "claim.h"
+#include "prefetch.h"
+
+#define	READAHEAD	2		/* Mail files read ahead, per
+					   connection */
+#define	MAXAHEAD	(MAXCONN*READAHEAD)
+					/* Most files that can be queued */
+#define	SMALLFILE	16384		/* Files smaller than this get a
+					   buffer to fit */
+#define	SLACK		512		/* Extra buffer space for a small
+					   file, in case it has grown */
+#define	STACKSIZE	32768		/* Stack size for reader thread */
+#define	POLLTIME	200		/* Interval between searches for new
+					   mail, when running as a daemon
+					   (ms) */
+#define	RETRYTIME	900		/* Interval between full searches,
+					   when running as a daemon (secs) */
+#define	INITNAMES	1024		/* Initial size of name set */
+
+/* Type definitions */
+
+typedef struct _AHEAD {			/* A file ready to be sent */
+PSPOOL		spool;			/* The file, or NULL if it could not
+					   be opened */
+UCHAR		name[CCHMAXPATH+1];	/* Name of the file */
+} AHEAD, *PAHEAD;
+
+typedef struct _NAMES {			/* A set of file names */
+PUCHAR		pool;			/* The names, each null terminated */
+ULONG		len;			/* Bytes used in pool */
+ULONG		max;			/* Size of pool */
+} NAMES, *PNAMES;
+
+/* Forward references */
+
+static	VOID	add_name(PNAMES, PUCHAR);
+static	BOOL	fetch(VOID);
+static	BOOL	find_name(PNAMES, PUCHAR);
+static	VOID	new_pass(BOOL);
+static	BOOL	next_file(PUCHAR, PULONG, PULONG);
+static	PSPOOL	open_file(PUCHAR, ULONG);
+static	VOID	reader(PVOID);
+static	BOOL	wait_pass(VOID);
+static	BOOL	wait_room(VOID);
+
+/* Local storage */
+
+static	PFL		filelist;	/* Files and directories to send */
+static	PFL		cursor;		/* Those still to do in this search */
+static	INT		order;		/* Order of files in a directory */
+static	BOOL		watch;		/* TRUE if searching repeatedly */
+static	ULONG		since;		/* Oldest files wanted in this search
+					   (see dirscan.c), or 0 for all */
+static	ULONG		passstamp;	/* Time this search started (in the
+					   same form) */
+static	ULONG		passtime;	/* Time this search started (ms) */
+static	ULONG		lastfull;	/* Time of last full search (ms) */
+static	ULONG		markstamp;	/* Oldest files to be counted by
+					   'prefetch_count', or 0 for all */
+static	BOOL		quiet;		/* TRUE if no file returned is still
+					   in use */
+static	NAMES		recent[2];	/* Newest files listed by last
+					   search, and by this one */
+static	INT		cur;		/* Set for this search */
+static	PDIRSCAN	scan;		/* Directory being sent, or NULL */
+static	BOOL		threaded;	/* TRUE if reader thread started */
+static	TID		tid;		/* The reader thread */
+static	HMTX		hmtx;		/* Guards the queue */
+static	HEV		hevready;	/* Posted when a file is queued, or
+					   there are no more */
+static	HEV		hevroom;	/* Posted when a file is taken from
+					   the queue, or reading is to stop */
+static	AHEAD		queue[MAXAHEAD];/* Files ready to be sent */
+static	INT		depth;		/* Places in the queue in use */
+static	INT		first;		/* Place of first file in queue */
+static	INT		queued;		/* Number of files in queue */
+static	BOOL		finished;	/* TRUE once there are no more files */
+static	BOOL		stopping;	/* TRUE when reading is to stop */
+
+
+/*
+ * Start reading ahead through the files and directories in 'list', for
+ * 'nconn' connections. The files in each directory are taken in the order
+ * given by 'ord' (ORDER_xxx). If 'repeat' is TRUE, the list is searched
+ * repeatedly; it must then contain only directories.
+ *
+ */
+
+VOID prefetch_start(PFL list, INT nconn, INT ord, BOOL repeat)
+{	APIRET rc;
+	INT t;
+
+	filelist = list;
+	order = ord;
+	watch = repeat;
+	quiet = TRUE;
+	scan = (PDIRSCAN) NULL;
+	lastfull = engine_now() - RETRYTIME*1000;
+	qindex_open(list);
+	claim_start(list);
+	new_pass(TRUE);
+	depth = nconn*READAHEAD;
+	if(depth > MAXAHEAD) depth = MAXAHEAD;
+	first = 0;
+	queued = 0;
+	finished = FALSE;
+	stopping = FALSE;
+	threaded = FALSE;
+
+	rc = DosCreateMutexSem((PSZ) NULL, &hmtx, 0, FALSE);
+	if(rc != NO_ERROR) return;
+	rc = DosCreateEventSem((PSZ) NULL, &hevready, 0, FALSE);
+	if(rc == NO_ERROR) {
+		rc = DosCreateEventSem((PSZ) NULL, &hevroom, 0, FALSE);
+		if(rc == NO_ERROR) {
+			threaded = TRUE;
+			t = _beginthread(reader, (PVOID) NULL, STACKSIZE,
+					(PVOID) NULL);
+			if(t != -1) {
+				tid = (TID) t;
+				return;
+			}
+			threaded = FALSE;
+			(VOID) DosCloseEventSem(hevroom);
+		}
+		(VOID) DosCloseEventSem(hevready);
+	}
+	(VOID) DosCloseMutexSem(hmtx);
+
+	error("cannot start read-ahead thread");
+}
+
+
+/*
+ * See if there is anything to send, waiting if necessary until the first
+ * file has been found, or there are known to be none. When the list is
+ * being searched repeatedly, this never waits.
+ *
+ * Returns TRUE if there is at least one file; otherwise returns FALSE.
+ *
+ */
+
+BOOL prefetch_any(VOID)
+{	BOOL rc;
+	ULONG posts;
+
+	if(threaded == FALSE) {
+		if(queued == 0 && finished == TRUE && watch == TRUE &&
+		   engine_now() - passtime >= POLLTIME) {
+			new_pass(quiet == TRUE || claim_all() == TRUE ?
+					TRUE : FALSE);
+			finished = FALSE;
+		}
+		if(queued == 0 && finished == FALSE) {
+			if(fetch() == FALSE) finished = TRUE;
+		}
+		return(queued != 0 ? TRUE : FALSE);
+	}
+
+	if(watch == TRUE) return(prefetch_ready());
+
+	for(;;) {
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+		if(queued != 0 || finished == TRUE) break;
+		(VOID) DosResetEventSem(hevready, &posts);
+		(VOID) DosReleaseMutexSem(hmtx);
+		(VOID) DosWaitEventSem(hevready, SEM_INDEFINITE_WAIT);
+	}
+	rc = queued != 0 ? TRUE : FALSE;
+	(VOID) DosReleaseMutexSem(hmtx);
+
+	return(rc);
+}
+
+
+/*
+ * See if there is a file ready to be sent now, without waiting.
+ *
+ * Returns TRUE if there is; otherwise returns FALSE.
+ *
+ */
+
+BOOL prefetch_ready(VOID)
+{	BOOL rc;
+
+	if(threaded == FALSE) return(prefetch_any());
+
+	(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	rc = queued != 0 ? TRUE : FALSE;
+	(VOID) DosReleaseMutexSem(hmtx);
+
+	return(rc);
+}
+
+
+/*
+ * Count the files in the directories being searched that were written (or
+ * created) since the last call of 'prefetch_mark', or all of them if it
+ * has not been called; counting stops at 'limit'. This makes a search of
+ * its own, and does not affect the files queued.
+ *
+ * Returns the number of files found.
+ *
+ */
+
+INT prefetch_count(INT limit)
+{	PFL temp;
+	PDIRSCAN ds;
+	INT n = 0;
+	ULONG size, stamp;
+	UCHAR name[CCHMAXPATH+1];
+
+	for(temp = filelist; temp != (PFL) NULL; temp = temp->next) {
+		if(n >= limit) break;
+		if(temp->isdir == FALSE) {
+			n++;
+			continue;
+		}
+		ds = dirscan_open(temp->name, ORDER_DIR, markstamp);
+		if(ds == (PDIRSCAN) NULL) continue;
+		while(n < limit &&
+		      dirscan_next(ds, name, &size, &stamp) == TRUE) n++;
+		dirscan_close(ds);
+	}
+
+	return(n);
+}
+
+
+/*
+ * Note the current time, so that later calls of 'prefetch_count' count
+ * only the files that arrive after it.
+ *
+ */
+
+VOID prefetch_mark(VOID)
+{	markstamp = dirscan_stamp();
+}
+
+
+/*
+ * Note that none of the files returned by 'prefetch_next' is still being
+ * sent, so that a full search of the list may be made, when one is due.
+ *
+ */
+
+VOID prefetch_quiet(VOID)
+{	if(threaded == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	quiet = TRUE;
+	if(threaded == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Wait until there is a file ready to be sent, when the list is being
+ * searched repeatedly. This is used when no files are being sent at all.
+ *
+ */
+
+VOID prefetch_wait(VOID)
+{	ULONG posts;
+
+	prefetch_quiet();
+
+	if(threaded == FALSE) {
+		while(prefetch_any() == FALSE) (VOID) DosSleep(POLLTIME);
+		return;
+	}
+
+	for(;;) {
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+		if(queued != 0) break;
+		(VOID) DosResetEventSem(hevready, &posts);
+		(VOID) DosReleaseMutexSem(hmtx);
+		(VOID) DosWaitEventSem(hevready, SEM_INDEFINITE_WAIT);
+	}
+	(VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Get the next mail file to be sent. Its name is placed in 'name', and the
+ * file, already open and with its first block read, is returned via
+ * 'spoolp'; this is NULL if the file could not be opened, which the caller
+ * should report. This only waits if the reader thread has not yet got as
+ * far as the next file.
+ *
+ * Returns:
+ *	TRUE		next file returned
+ *	FALSE		no more files
+ *
+ */
+
+BOOL prefetch_next(PUCHAR name, PSPOOL *spoolp)
+{	PAHEAD ap;
+
+	if(prefetch_any() == FALSE) return(FALSE);
+
+	if(threaded == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	ap = &queue[first];
+	strcpy(name, ap->name);
+	*spoolp = ap->spool;
+	first = (first + 1) % depth;
+	queued--;
+	quiet = FALSE;
+	if(threaded == TRUE) {
+		(VOID) DosPostEventSem(hevroom);
+		(VOID) DosReleaseMutexSem(hmtx);
+	}
+
+	return(TRUE);
+}
+
+
+/*
+ * Stop reading ahead. Any files that have been read, but not sent, are
+ * closed; they are left for another time, and their claims given up. This
+ * does nothing if reading ahead was never started.
+ *
+ */
+
+VOID prefetch_stop(VOID)
+{	INT i;
+
+	if(threaded == TRUE) {
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+		stopping = TRUE;
+		(VOID) DosPostEventSem(hevroom);
+		(VOID) DosReleaseMutexSem(hmtx);
+		(VOID) DosWaitThread(&tid, DCWW_WAIT);
+
+		(VOID) DosCloseEventSem(hevroom);
+		(VOID) DosCloseEventSem(hevready);
+		(VOID) DosCloseMutexSem(hmtx);
+		threaded = FALSE;
+	}
+
+	while(queued != 0) {
+		spool_close(queue[first].spool);
+		first = (first + 1) % depth;
+		queued--;
+	}
+
+	dirscan_close(scan);
+	scan = (PDIRSCAN) NULL;
+	claim_stop();
+	qindex_close();
+
+	for(i = 0; i < 2; i++) {
+		if(recent[i].pool != (PUCHAR) NULL) free(recent[i].pool);
+		recent[i].pool = (PUCHAR) NULL;
+		recent[i].len = recent[i].max = 0;
+	}
+}
+
+
+/*
+ * The reader thread. Each mail file in turn is opened, and its first block
+ * read, as soon as there is a place for it in the queue.
+ *
+ */
+
+static VOID reader(PVOID arg)
+{	while(wait_room() == TRUE) {
+		if(fetch() == TRUE) continue;
+		if(watch == FALSE || wait_pass() == FALSE) break;
+	}
+
+	(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	finished = TRUE;
+	(VOID) DosPostEventSem(hevready);
+	(VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Wait for a place in the queue.
+ *
+ * Returns:
+ *	TRUE		there is a place
+ *	FALSE		reading is to stop
+ *
+ */
+
+static BOOL wait_room(VOID)
+{	BOOL rc;
+	ULONG posts;
+
+	for(;;) {
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+		if(stopping == TRUE || queued < depth) break;
+		(VOID) DosResetEventSem(hevroom, &posts);
+		(VOID) DosReleaseMutexSem(hmtx);
+		(VOID) DosWaitEventSem(hevroom, SEM_INDEFINITE_WAIT);
+	}
+	rc = stopping == TRUE ? FALSE : TRUE;
+	(VOID) DosReleaseMutexSem(hmtx);
+
+	return(rc);
+}
+
+
+/*
+ * Note that a search is finished, wait until it is time for the next one,
+ * and set that up. A full search is only made if none of the files
+ * already returned is in use, or all files are claimed before use.
+ *
+ * Returns:
+ *	TRUE		another search is to be made
+ *	FALSE		reading is to stop
+ *
+ */
+
+static BOOL wait_pass(VOID)
+{	BOOL full;
+	LONG left;
+	ULONG posts;
+
+	(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	finished = TRUE;
+	(VOID) DosPostEventSem(hevready);
+	for(;;) {
+		left = POLLTIME - (LONG) (engine_now() - passtime);
+		if(stopping == TRUE || left <= 0) break;
+		(VOID) DosResetEventSem(hevroom, &posts);
+		(VOID) DosReleaseMutexSem(hmtx);
+		(VOID) DosWaitEventSem(hevroom, (ULONG) left);
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	}
+	if(stopping == TRUE) {
+		(VOID) DosReleaseMutexSem(hmtx);
+		return(FALSE);
+	}
+	full = (quiet == TRUE && queued == 0) || claim_all() == TRUE ?
+			TRUE : FALSE;
+	finished = FALSE;
+	(VOID) DosReleaseMutexSem(hmtx);
+
+	new_pass(full);
+
+	return(TRUE);
+}
+
+
+/*
+ * Set up for another search of the list. Only files written since the
+ * last search started are wanted, unless it is time for a full search,
+ * and one is allowed ('full' is TRUE). It is time for one every
+ * RETRYTIME, and whenever a file that could not be sent is due to be
+ * tried again.
+ *
+ */
+
+static VOID new_pass(BOOL full)
+{	ULONG now = engine_now();
+
+	if(full == TRUE && (now - lastfull >= RETRYTIME*1000 ||
+	   qindex_next() <= (ULONG) time((time_t *) NULL))) {
+		since = 0;
+		lastfull = now;
+		qindex_mark();
+	} else {
+		since = passstamp;
+	}
+	passstamp = dirscan_stamp();
+	passtime = now;
+	cursor = filelist;
+	cur = 1 - cur;
+	recent[cur].len = 0;
+}
+
+
+/*
+ * Find the next mail file, claim it, open it and read its first block, and
+ * add it to the queue; there must be a place for it.
+ *
+ * Returns:
+ *	TRUE		file queued
+ *	FALSE		no more files
+ *
+ */
+
+static BOOL fetch(VOID)
+{	PAHEAD ap;
+	PSPOOL sf;
+	ULONG size, stamp;
+	UCHAR name[CCHMAXPATH+1];
+	UCHAR path[CCHMAXPATH+1];
+
+	do {
+		if(next_file(name, &size, &stamp) == FALSE) return(FALSE);
+	} while(claim_take(name, path) == FALSE);
+	sf = open_file(path, size);
+
+	/* A file as new as this search will be listed by the next one too */
+
+	if(watch == TRUE && stamp >= passstamp) add_name(&recent[cur], name);
+
+	if(threaded == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	ap = &queue[(first + queued) % depth];
+	strcpy(ap->name, name);
+	ap->spool = sf;
+	queued++;
+	if(threaded == TRUE) {
+		(VOID) DosPostEventSem(hevready);
+		(VOID) DosReleaseMutexSem(hmtx);
+	}
+
+	return(TRUE);
+}
+
+
+/*
+ * Open the mail file 'name', and read its first block. If the size of the
+ * file ('size') is known, and it is small, the buffer is made to fit it.
+ *
+ * Returns:
+ *	pointer to the context for the file (see spool.c)
+ *	NULL if the file cannot be opened
+ *
+ */
+
+static PSPOOL open_file(PUCHAR name, ULONG size)
+{	PSPOOL sf;
+	INT bufsize = 0;		/* Default size */
+
+	if(size != 0 && size < SMALLFILE) bufsize = (INT) size + SLACK;
+
+	sf = spool_open(name, bufsize);
+	if(sf != (PSPOOL) NULL) spool_preload(sf);
+
+	return(sf);
+}
+
+
+/*
+ * Get the name of the next file to be sent, working through the list of
+ * files and directories given. The size of the file is returned via
+ * 'sizep', if it is known; otherwise zero is returned. Its time (see
+ * dirscan.c) is returned via 'stampp', or zero if not known.
+ *
+ * Returns:
+ *	TRUE		name of next file placed in 'name'
+ *	FALSE		no more files
+ *
+ */
+
+static BOOL next_file(PUCHAR name, PULONG sizep, PULONG stampp)
+{	PFL temp;
+
+	for(;;) {
+		if(scan != (PDIRSCAN) NULL) {
+			while(dirscan_next(scan, name, sizep, stampp) ==
+				TRUE) {
+				/* A file returned by the last search, and
+				   listed again by this one, is still kept */
+
+				if(since != 0 &&
+				   find_name(&recent[1-cur], name) == TRUE) {
+					if(*stampp >= passstamp)
+						add_name(&recent[cur], name);
+					continue;
+				}
+				if(qindex_due(name, *sizep, *stampp) == TRUE)
+					return(TRUE);
+			}
+			dirscan_close(scan);
+			scan = (PDIRSCAN) NULL;
+		}
+
+		if(cursor == (PFL) NULL) {
+			/* Any file not found by a full search has gone */
+
+			if(since == 0) qindex_sweep();
+			return(FALSE);
+		}
+		temp = cursor;
+		cursor = temp->next;
+
+		if(temp->isdir == FALSE) {
+			strcpy(name, temp->name);
+			*sizep = 0;
+			*stampp = 0;
+			return(TRUE);
+		}
+
+		scan = dirscan_open(temp->name, order, since);
+	}
+}
+
+
+/*
+ * Add the file name 'name' to the set 'np'. If there is no memory for it,
+ * it is simply left out; the file may then be tried once more than it
+ * need be.
+ *
+ */
+
+static VOID add_name(PNAMES np, PUCHAR name)
+{	ULONG len = strlen(name) + 1;
+	ULONG size;
+	PVOID p;
+
+	if(np->len + len > np->max) {
+		size = np->max == 0 ? INITNAMES : np->max*2;
+		while(np->len + len > size) size *= 2;
+		p = realloc(np->pool, size);
+		if(p == (PVOID) NULL) return;
+		np->pool = (PUCHAR) p;
+		np->max = size;
+	}
+
+	memcpy(&np->pool[np->len], name, len);
+	np->len += len;
+}
+
+
+/*
+ * See if the file name 'name' is in the set 'np'.
+ *
+ * Returns TRUE if it is; otherwise returns FALSE.
+ *
+ */
+
+static BOOL find_name(PNAMES np, PUCHAR name)
+{	ULONG i;
+
+	for(i = 0; i < np->len; i += strlen(&np->pool[i]) + 1) {
+		if(strcmp(&np->pool[i], name) == 0) return(TRUE);
+	}
+
+	return(FALSE);
+}
+
+/*
+ * End of file: prefetch.c
+ *
+ */
+
+
\ No newline at end of file
@@ -0,0 +1,27 @@
+/*
+ * File: prefetch.h
+ *
+ * Read-ahead of the mail files to be sent; header file.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+/* External references */
+
+extern	BOOL	prefetch_any(VOID);
+extern	INT	prefetch_count(INT);
+extern	VOID	prefetch_mark(VOID);
+extern	BOOL	prefetch_next(PUCHAR, PSPOOL *);
+extern	BOOL	prefetch_ready(VOID);
+extern	VOID	prefetch_quiet(VOID);
+extern	VOID	prefetch_start(PFL, INT, INT, BOOL);
+extern	VOID	prefetch_stop(VOID);
+extern	VOID	prefetch_wait(VOID);
+
+/*
+ * End of file: prefetch.h
+ *
+ */
+
+
\ No newline at end of file
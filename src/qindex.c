@@ -0,0 +1,816 @@
+/*
+ * File: qindex.c
+ *
+ * Index of the mail files queued in the spool directories.
+ *
+ * Each spool directory has an index file of its own, kept in the directory
+ * itself but marked hidden, so that it is not listed as mail (see
+ * dirscan.c). It holds a fixed size record for each mail file that has
+ * been found there: its size and time, a summary of its envelope, the
+ * number of attempts made to send it, the last failure reply, and the time
+ * of the next attempt. A file that is not yet due for another attempt is
+ * skipped without being opened.
+ *
+ * The wait before each attempt is twice as long as the one before, up to a
+ * limit, so that mail which is being greylisted or throttled by the server
+ * does not waste connections, or hold up new mail. Each wait is shortened
+ * by a random amount (up to a quarter), so that files which failed
+ * together are not all tried together again. A file that still has not
+ * been sent after LIFETIME is not tried again at all.
+ *
+ * The whole index is read into memory when the program starts, and from
+ * then on each change is written straight to its own record, so that the
+ * file is never rewritten as a whole. A record is freed when its file is
+ * sent, or is found to have gone, and is used again for the next new file.
+ *
+ * Several copies of the program may share the spool directories (see
+ * claim.c), and so the index. Each change is made with the first record
+ * (the header) of the file locked, and the header counts the changes; a
+ * copy that finds the count changed since it last looked reads the index
+ * again before using it. A file that is not found by a full search is not
+ * taken to have gone if it is in a work area; another copy may be sending
+ * it.
+ *
+ * A fanned out spool directory has one index for the directory and all of
+ * its subdirectories, kept in the directory itself; the records for files
+ * in the subdirectories are named by their path below it (x\y\name), so
+ * that the program does not hold an index file open for every one.
+ *
+ * The index only ever describes what is in the spool directory, which
+ * remains the true record of the mail queued; if the index is lost or
+ * damaged, it is simply started again.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#pragma	strings(readonly)
+
+#pragma	alloc_text(a_init_seg, qindex_open)
+
+#define	INCL_DOSERRORS
+#define	INCL_DOSFILEMGR
+#define	INCL_DOSSEMAPHORES
+#define	OS2
+#include <os2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtp.h"
+#include "claim.h"
+#include "qindex.h"
+
+#define	IDXFILE		"SMTP.IDX"	/* Name of index file, in each spool
+					   directory */
+#define	IDXMAGIC	"SMTP queue index"
+					/* Identifies an index file */
+#define	IDXVERSION	2		/* Format of index file */
+#define	QNAMELEN	32		/* Room for file name in index,
+					   including any subdirectory */
+#define	QREPLYLEN	36		/* Room for failure reply in index */
+#define	RETRYMIN	300		/* Wait before first retry (secs) */
+#define	RETRYMAX	14400		/* Longest wait between retries
+					   (secs) */
+#define	LIFETIME	432000		/* Time after which a file is no
+					   longer tried (secs) */
+#define	NEVER		((ULONG) ~0)	/* Next attempt time of such a file */
+#define	HASHSIZE	1024		/* Size of hash table; a power of 2 */
+#define	INITRECS	256		/* Initial room for records */
+#define	NOREC		-1		/* No record */
+#define	LOCKWAIT	10000		/* Longest wait for another copy of
+					   the program to unlock an index
+					   (ms) */
+
+/* Type definitions */
+
+typedef struct _QREC {			/* One record of an index file */
+ULONG		size;			/* Size of mail file */
+ULONG		stamp;			/* Time it was written or created
+					   (see dirscan.c) */
+ULONG		queued;			/* Time it was first found */
+ULONG		next;			/* Time of next attempt to send it,
+					   or 0 if due now */
+USHORT		attempts;		/* Attempts made to send it */
+USHORT		rcpts;			/* Recipients, or 0 if not known */
+UCHAR		name[QNAMELEN];		/* Name of file; empty if record is
+					   free */
+UCHAR		sender[QADDRLEN];	/* Sender, if known */
+UCHAR		reply[QREPLYLEN];	/* Last failure reply */
+} QREC, *PQREC;
+
+typedef struct _QDIR {			/* Index for one spool directory */
+struct	_QDIR	*next;			/* Next directory */
+PUCHAR		dirname;		/* Name of the directory */
+BOOL		fanout;			/* TRUE if fanned out, so that it
+					   also holds files in x\y */
+HFILE		hf;			/* Index file */
+PQREC		recs;			/* Records; the first is the header */
+PINT		link;			/* Next record with same hash, or
+					   next free record */
+PUCHAR		marks;			/* Record found by the current full
+					   search, if non-zero */
+INT		nrecs;			/* Records in use or free */
+INT		maxrecs;		/* Room in 'recs' */
+INT		free;			/* First free record */
+INT		hash[HASHSIZE];		/* First record for each hash */
+ULONG		gen;			/* Changes to the file, as counted in
+					   its header when last read */
+BOOL		locked;			/* TRUE if file is locked */
+BOOL		changed;		/* TRUE if changed since locked */
+} QDIR, *PQDIR;
+
+/* Forward references */
+
+static	INT	alloc_rec(PQDIR);
+static	PQREC	find(PUCHAR, PQDIR *, PINT);
+static	PQDIR	find_dir(PUCHAR, PUCHAR *);
+static	VOID	free_rec(PQDIR, INT);
+static	BOOL	grow(PQDIR, INT);
+static	ULONG	hash(PUCHAR);
+static	BOOL	load(PQDIR);
+static	VOID	lock_dir(PQDIR);
+static	ULONG	retry_delay(INT);
+static	VOID	unlink_rec(PQDIR, INT);
+static	VOID	unlock_dir(PQDIR);
+static	VOID	write_rec(PQDIR, INT);
+
+/* Local storage */
+
+static	PQDIR	dirs;			/* Indexes in use */
+static	HMTX	hmtx;			/* Guards the indexes */
+static	BOOL	locking;		/* TRUE if mutex created */
+
+
+/*
+ * Open the index for each of the directories in 'list'. A directory whose
+ * index cannot be opened is simply not indexed, and all of its files are
+ * tried every time. The subdirectories of a fanned out directory use the
+ * index of the directory itself.
+ *
+ */
+
+VOID qindex_open(PFL list)
+{	PFL temp;
+	PQDIR qp;
+	APIRET rc;
+	ULONG action;
+	UCHAR name[CCHMAXPATH+1];
+
+	dirs = (PQDIR) NULL;
+	srand((UINT) time((time_t *) NULL));
+	locking = DosCreateMutexSem((PSZ) NULL, &hmtx, 0, FALSE) == NO_ERROR ?
+			TRUE : FALSE;
+
+	for(temp = list; temp != (PFL) NULL; temp = temp->next) {
+		if(temp->isdir == FALSE || temp->root != (PFL) NULL) continue;
+
+		qp = (PQDIR) xmalloc(sizeof(QDIR));
+		if(qp == (PQDIR) NULL) return;
+		memset(qp, 0, sizeof(QDIR));
+		qp->dirname = temp->name;
+		qp->fanout = temp->fanout;
+
+		sprintf(name, "%s\\%s", temp->name, IDXFILE);
+		rc = DosOpen(
+			name,
+			&qp->hf,
+			&action,
+			0,
+			FILE_HIDDEN,
+			OPEN_ACTION_CREATE_IF_NEW | OPEN_ACTION_OPEN_IF_EXISTS,
+			OPEN_FLAGS_RANDOM | OPEN_FLAGS_NOINHERIT |
+				OPEN_SHARE_DENYNONE | OPEN_ACCESS_READWRITE,
+			(PEAOP2) NULL);
+		if(rc != NO_ERROR) {
+			error("cannot open queue index %s, rc = %d", name, rc);
+			free(qp);
+			continue;
+		}
+
+		if(grow(qp, INITRECS) == FALSE) {
+			(VOID) DosClose(qp->hf);
+			free(qp);
+			continue;
+		}
+		lock_dir(qp);			/* Reads it */
+		unlock_dir(qp);
+		if(qp->nrecs == 0) {		/* Out of memory */
+			(VOID) DosClose(qp->hf);
+			free(qp->recs);
+			free(qp->link);
+			free(qp->marks);
+			free(qp);
+			continue;
+		}
+
+		qp->next = dirs;
+		dirs = qp;
+	}
+}
+
+
+/*
+ * Close all of the indexes.
+ *
+ */
+
+VOID qindex_close(VOID)
+{	PQDIR qp;
+
+	while(dirs != (PQDIR) NULL) {
+		qp = dirs;
+		dirs = qp->next;
+		(VOID) DosClose(qp->hf);
+		free(qp->recs);
+		free(qp->link);
+		free(qp->marks);
+		free(qp);
+	}
+
+	if(locking == TRUE) {
+		(VOID) DosCloseMutexSem(hmtx);
+		locking = FALSE;
+	}
+}
+
+
+/*
+ * Check whether the mail file 'name', of size 'size', written at 'stamp'
+ * (see dirscan.c), is due to be sent. A file not already in the index is
+ * added to it; if the size or time of a file have changed, it is taken to
+ * be a new file with the same name. The file is also marked as found, for
+ * 'qindex_sweep'.
+ *
+ * Returns:
+ *	TRUE		file should be sent now (or is not indexed)
+ *	FALSE		file is not yet due to be tried again
+ *
+ */
+
+BOOL qindex_due(PUCHAR name, ULONG size, ULONG stamp)
+{	PQDIR qp;
+	PQREC rp;
+	INT n;
+	PUCHAR p;
+	BOOL rc = TRUE;
+
+	if(dirs == (PQDIR) NULL) return(TRUE);
+
+	if(locking == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	rp = find(name, &qp, &n);
+	if(qp == (PQDIR) NULL) {	/* Not in an indexed directory */
+		if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+		return(TRUE);
+	}
+
+	if(rp != (PQREC) NULL &&
+	   (rp->size != size || rp->stamp != stamp)) {
+		free_rec(qp, n);		/* Replaced by a new file */
+		rp = (PQREC) NULL;
+	}
+
+	if(rp == (PQREC) NULL) {
+		p = &name[strlen(qp->dirname)+1];
+		if(strlen(p) < QNAMELEN) n = alloc_rec(qp);
+		else n = NOREC;			/* Name too long to index */
+		if(n != NOREC) {
+			rp = &qp->recs[n];
+			memset(rp, 0, sizeof(QREC));
+			strcpy(rp->name, p);
+			rp->size = size;
+			rp->stamp = stamp;
+			rp->queued = (ULONG) time((time_t *) NULL);
+			qp->link[n] = qp->hash[hash(p)];
+			qp->hash[hash(p)] = n;
+			write_rec(qp, n);
+		}
+	}
+
+	if(rp != (PQREC) NULL) {
+		qp->marks[n] = 1;
+		if(rp->next > (ULONG) time((time_t *) NULL)) rc = FALSE;
+	}
+	unlock_dir(qp);
+	if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+
+	return(rc);
+}
+
+
+/*
+ * Record a summary of the envelope of the mail file 'name': the sender,
+ * 'sender', and the number of recipients, 'rcpts'.
+ *
+ */
+
+VOID qindex_envelope(PUCHAR name, PUCHAR sender, INT rcpts)
+{	PQDIR qp;
+	PQREC rp;
+	INT n;
+
+	if(dirs == (PQDIR) NULL) return;
+
+	if(locking == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	rp = find(name, &qp, &n);
+	if(rp != (PQREC) NULL) {
+		strncpy(rp->sender, sender, QADDRLEN-1);
+		rp->sender[QADDRLEN-1] = '\0';
+		rp->rcpts = (USHORT) rcpts;
+		write_rec(qp, n);
+	}
+	unlock_dir(qp);
+	if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Note that the mail file 'name' has been sent, and removed; its record
+ * is freed.
+ *
+ */
+
+VOID qindex_done(PUCHAR name)
+{	PQDIR qp;
+	PQREC rp;
+	INT n;
+
+	if(dirs == (PQDIR) NULL) return;
+
+	if(locking == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	rp = find(name, &qp, &n);
+	if(rp != (PQREC) NULL) free_rec(qp, n);
+	unlock_dir(qp);
+	if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Note that the mail file 'name' could not be sent, the server's reply
+ * being 'reply' (empty if the failure was not the server's), and work out
+ * when it is to be tried again. If it has been queued for longer than
+ * LIFETIME, it is not tried again.
+ *
+ * Returns:
+ *	time until the next attempt (secs)
+ *	0 if the file is not indexed
+ *	QI_EXPIRED if the file is not to be tried again
+ *
+ */
+
+LONG qindex_failed(PUCHAR name, PUCHAR reply)
+{	PQDIR qp;
+	PQREC rp;
+	INT i, n;
+	ULONG now;
+	LONG rc = 0;
+
+	if(dirs == (PQDIR) NULL) return(0);
+
+	if(locking == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	rp = find(name, &qp, &n);
+	if(rp != (PQREC) NULL) {
+		now = (ULONG) time((time_t *) NULL);
+		rp->attempts++;
+		for(i = 0; i < QREPLYLEN-1 && reply[i] >= ' '; i++)
+			rp->reply[i] = reply[i];
+		rp->reply[i] = '\0';	/* Without the line end */
+		if(now - rp->queued >= LIFETIME) {
+			rp->next = NEVER;
+			rc = QI_EXPIRED;
+		} else {
+			rc = (LONG) retry_delay(rp->attempts);
+			rp->next = now + rc;
+		}
+		write_rec(qp, n);
+	}
+	unlock_dir(qp);
+	if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+
+	return(rc);
+}
+
+
+/*
+ * Return the time at which the first of the files that could not be sent
+ * is due to be tried again, or ~0 if there are none.
+ *
+ */
+
+ULONG qindex_next(VOID)
+{	PQDIR qp;
+	PQREC rp;
+	INT i;
+	ULONG next = ~0UL;
+
+	if(locking == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	for(qp = dirs; qp != (PQDIR) NULL; qp = qp->next) {
+		lock_dir(qp);
+		for(i = 1; i < qp->nrecs; i++) {
+			rp = &qp->recs[i];
+			if(rp->name[0] != '\0' && rp->next != 0 &&
+			   rp->next != NEVER && rp->next < next)
+				next = rp->next;
+		}
+		unlock_dir(qp);
+	}
+	if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+
+	return(next);
+}
+
+
+/*
+ * Start a full search of the spool directories; every record is marked as
+ * not yet found.
+ *
+ */
+
+VOID qindex_mark(VOID)
+{	PQDIR qp;
+
+	if(locking == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	for(qp = dirs; qp != (PQDIR) NULL; qp = qp->next)
+		memset(qp->marks, 0, qp->maxrecs);
+	if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Finish a full search of the spool directories. The records of files
+ * that were not found by it are freed, once it is certain that the files
+ * have gone. A file may instead have been claimed (see claim.c) by some
+ * copy of the program, and be being sent; or it may have been returned
+ * to its directory after the search had passed it.
+ *
+ */
+
+VOID qindex_sweep(VOID)
+{	PQDIR qp;
+	INT i;
+	FILESTATUS3 fs;
+	UCHAR name[CCHMAXPATH+1];
+
+	if(locking == TRUE)
+		(VOID) DosRequestMutexSem(hmtx, SEM_INDEFINITE_WAIT);
+	for(qp = dirs; qp != (PQDIR) NULL; qp = qp->next) {
+		lock_dir(qp);
+		for(i = 1; i < qp->nrecs; i++) {
+			if(qp->recs[i].name[0] == '\0' || qp->marks[i] != 0)
+				continue;
+			sprintf(name, "%s\\%s", qp->dirname, qp->recs[i].name);
+			if(DosQueryPathInfo(name, FIL_STANDARD, &fs,
+					sizeof(fs)) == NO_ERROR ||
+			   claim_held(name) == TRUE) continue;
+			free_rec(qp, i);
+		}
+		unlock_dir(qp);
+	}
+	if(locking == TRUE) (VOID) DosReleaseMutexSem(hmtx);
+}
+
+
+/*
+ * Read the index file of 'qp' into memory, and build its hash table and
+ * free list; the file must be locked. If the file is new, or not a valid
+ * index, it is started again. The marks made by a full search are kept;
+ * if another copy of the program has since used a record for a different
+ * file, that file is only kept until the next full search.
+ *
+ * Returns:
+ *	TRUE		index ready
+ *	FALSE		out of memory; the copy in memory is left as it was
+ *
+ */
+
+static BOOL load(PQDIR qp)
+{	APIRET rc;
+	ULONG got, pos;
+	PQREC rp;
+	INT i, n;
+	FILESTATUS3 fs;
+
+	rc = DosQueryFileInfo(qp->hf, FIL_STANDARD, &fs, sizeof(fs));
+	n = rc == NO_ERROR ? (INT) (fs.cbFile/sizeof(QREC)) : 0;
+	if(n > qp->maxrecs && grow(qp, n) == FALSE) return(FALSE);
+
+	got = 0;
+	if(n != 0) {
+		(VOID) DosSetFilePtr(qp->hf, 0, FILE_BEGIN, &pos);
+		rc = DosRead(qp->hf, qp->recs, n*sizeof(QREC), &got);
+		if(rc != NO_ERROR) got = 0;
+	}
+	qp->nrecs = n;
+
+	for(i = 0; i < HASHSIZE; i++) qp->hash[i] = NOREC;
+	qp->free = NOREC;
+
+	rp = &qp->recs[0];
+	if(n == 0 || got != n*sizeof(QREC) ||
+	   strcmp(rp->name, IDXMAGIC) != 0 ||
+	   rp->size != sizeof(QREC) || rp->stamp != IDXVERSION) {
+		memset(rp, 0, sizeof(QREC));	/* Start again */
+		strcpy(rp->name, IDXMAGIC);
+		rp->size = sizeof(QREC);
+		rp->stamp = IDXVERSION;
+		rp->next = qp->gen;
+		qp->nrecs = 1;
+		(VOID) DosSetFileSize(qp->hf, 0);
+		qp->changed = TRUE;		/* Others must read it again */
+		return(TRUE);
+	}
+	qp->gen = rp->next;
+
+	/* Build the free list backwards, so that the lowest free record is
+	   used first */
+
+	for(i = qp->nrecs - 1; i > 0; i--) {
+		rp = &qp->recs[i];
+		rp->name[QNAMELEN-1] = '\0';
+		if(rp->name[0] == '\0') {
+			qp->link[i] = qp->free;
+			qp->free = i;
+		} else {
+			qp->link[i] = qp->hash[hash(rp->name)];
+			qp->hash[hash(rp->name)] = i;
+		}
+	}
+
+	return(TRUE);
+}
+
+
+/*
+ * Lock the index file of 'qp' against the other copies of the program,
+ * and read it again if one of them has changed it since it was last read
+ * here. If it cannot be locked, the copy in memory is used as it is.
+ *
+ */
+
+static VOID lock_dir(PQDIR qp)
+{	FILELOCK none, lock;
+	QREC hdr;
+	ULONG got, pos;
+	APIRET rc;
+
+	none.lOffset = 0;
+	none.lRange = 0;
+	lock.lOffset = 0;
+	lock.lRange = sizeof(QREC);
+	rc = DosSetFileLocks(qp->hf, &none, &lock, LOCKWAIT, 0);
+	qp->locked = rc == NO_ERROR ? TRUE : FALSE;
+	qp->changed = FALSE;
+	if(qp->locked == FALSE && qp->nrecs != 0) return;
+
+	got = 0;
+	(VOID) DosSetFilePtr(qp->hf, 0, FILE_BEGIN, &pos);
+	rc = DosRead(qp->hf, &hdr, sizeof(QREC), &got);
+	if(qp->nrecs == 0 || rc != NO_ERROR || got != sizeof(QREC) ||
+	   hdr.next != qp->gen)
+		(VOID) load(qp);
+}
+
+
+/*
+ * Unlock the index file of 'qp', if it is not NULL. If the index has been
+ * changed, the change is first counted in its header, so that the other
+ * copies of the program read it again.
+ *
+ */
+
+static VOID unlock_dir(PQDIR qp)
+{	FILELOCK none, lock;
+
+	if(qp == (PQDIR) NULL) return;
+
+	if(qp->changed == TRUE && qp->nrecs != 0) {
+		qp->gen++;
+		qp->recs[0].next = qp->gen;
+		write_rec(qp, 0);
+	}
+	qp->changed = FALSE;
+
+	if(qp->locked == FALSE) return;
+	none.lOffset = 0;
+	none.lRange = 0;
+	lock.lOffset = 0;
+	lock.lRange = sizeof(QREC);
+	(VOID) DosSetFileLocks(qp->hf, &lock, &none, 0, 0);
+	qp->locked = FALSE;
+}
+
+
+/*
+ * Find the record for the mail file 'name'. The index for its directory
+ * is returned via 'qpp' (NULL if the directory is not indexed), and the
+ * number of the record via 'np'. The index is locked (see 'lock_dir');
+ * the caller must unlock it.
+ *
+ * Returns:
+ *	pointer to the record
+ *	NULL if none
+ *
+ */
+
+static PQREC find(PUCHAR name, PQDIR *qpp, PINT np)
+{	PQDIR qp;
+	PUCHAR p;
+	INT n;
+
+	qp = find_dir(name, &p);
+	*qpp = qp;
+	if(qp == (PQDIR) NULL) return((PQREC) NULL);
+	lock_dir(qp);
+
+	for(n = qp->hash[hash(p)]; n != NOREC; n = qp->link[n]) {
+		if(strcmp(qp->recs[n].name, p) == 0) {
+			*np = n;
+			return(&qp->recs[n]);
+		}
+	}
+
+	return((PQREC) NULL);
+}
+
+
+/*
+ * Find the index for the directory holding the mail file 'name'. A
+ * pointer to the name of the file within that directory (including any
+ * subdirectory, if it is fanned out) is returned via 'relp'.
+ *
+ * Returns:
+ *	pointer to the index
+ *	NULL if the file is not in an indexed directory
+ *
+ */
+
+static PQDIR find_dir(PUCHAR name, PUCHAR *relp)
+{	PQDIR qp;
+	ULONG len;
+
+	for(qp = dirs; qp != (PQDIR) NULL; qp = qp->next) {
+		len = strlen(qp->dirname);
+		if(strncmp(qp->dirname, name, len) != 0 ||
+		   name[len] != '\\') continue;
+		if(qp->fanout == FALSE && strchr(&name[len+1], '\\') != NULL)
+			continue;
+		*relp = &name[len+1];
+		return(qp);
+	}
+
+	return((PQDIR) NULL);
+}
+
+
+/*
+ * Get a free record in the index 'qp', taking the first on the free list,
+ * or adding one at the end. The tables grow as needed.
+ *
+ * Returns:
+ *	number of the record
+ *	NOREC if out of memory
+ *
+ */
+
+static INT alloc_rec(PQDIR qp)
+{	INT n;
+
+	if(qp->free != NOREC) {
+		n = qp->free;
+		qp->free = qp->link[n];
+		return(n);
+	}
+
+	if(qp->nrecs == qp->maxrecs && grow(qp, qp->maxrecs*2) == FALSE)
+		return(NOREC);
+
+	return(qp->nrecs++);
+}
+
+
+/*
+ * Make room for 'size' records in the tables of the index 'qp'.
+ *
+ * Returns:
+ *	TRUE		room made
+ *	FALSE		out of memory
+ *
+ */
+
+static BOOL grow(PQDIR qp, INT size)
+{	PVOID p;
+
+	p = realloc(qp->recs, size*sizeof(QREC));
+	if(p == (PVOID) NULL) return(FALSE);
+	qp->recs = (PQREC) p;
+	p = realloc(qp->link, size*sizeof(INT));
+	if(p == (PVOID) NULL) return(FALSE);
+	qp->link = (PINT) p;
+	p = realloc(qp->marks, size);
+	if(p == (PVOID) NULL) return(FALSE);
+	qp->marks = (PUCHAR) p;
+	memset(&qp->marks[qp->maxrecs], 0, size - qp->maxrecs);
+	qp->maxrecs = size;
+
+	return(TRUE);
+}
+
+
+/*
+ * Free record 'n' of the index 'qp', removing it from its hash chain and
+ * adding it to the free list.
+ *
+ */
+
+static VOID free_rec(PQDIR qp, INT n)
+{	unlink_rec(qp, n);
+	memset(&qp->recs[n], 0, sizeof(QREC));
+	write_rec(qp, n);
+	qp->link[n] = qp->free;
+	qp->free = n;
+}
+
+
+/*
+ * Remove record 'n' of the index 'qp' from its hash chain.
+ *
+ */
+
+static VOID unlink_rec(PQDIR qp, INT n)
+{	PINT lp;
+
+	lp = &qp->hash[hash(qp->recs[n].name)];
+	while(*lp != NOREC) {
+		if(*lp == n) {
+			*lp = qp->link[n];
+			return;
+		}
+		lp = &qp->link[*lp];
+	}
+}
+
+
+/*
+ * Write record 'n' of the index 'qp' to the index file. If this fails,
+ * the index in memory is still correct; the file is only out of date.
+ * A change to any record but the header is noted, to be counted when the
+ * index is unlocked.
+ *
+ */
+
+static VOID write_rec(PQDIR qp, INT n)
+{	ULONG pos, done;
+
+	if(n != 0) qp->changed = TRUE;
+
+	(VOID) DosSetFilePtr(qp->hf, n*sizeof(QREC), FILE_BEGIN, &pos);
+	(VOID) DosWrite(qp->hf, &qp->recs[n], sizeof(QREC), &done);
+}
+
+
+/*
+ * Work out the wait before the next attempt to send a file, after
+ * 'attempts' attempts. The wait doubles each time, from RETRYMIN up to
+ * RETRYMAX, and is then shortened by a random amount of up to a quarter.
+ *
+ * Returns the wait (secs).
+ *
+ */
+
+static ULONG retry_delay(INT attempts)
+{	ULONG delay = RETRYMIN;
+
+	while(--attempts > 0 && delay < RETRYMAX) delay *= 2;
+	if(delay > RETRYMAX) delay = RETRYMAX;
+
+	return(delay - (ULONG) rand() % (delay/4 + 1));
+}
+
+
+/*
+ * Compute the hash of the file name 'name'.
+ *
+ */
+
+static ULONG hash(PUCHAR name)
+{	ULONG h = 0;
+
+	while(*name != '\0') h = h*31 + *name++;
+
+	return(h & (HASHSIZE-1));
+}
+
+/*
+ * End of file: qindex.c
+ *
+ */
+
+
\ No newline at end of file
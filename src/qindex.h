@@ -0,0 +1,30 @@
+/*
+ * File: qindex.h
+ *
+ * Index of the mail files queued in the spool directories; header file.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#define	QADDRLEN		40	/* Room for sender in index */
+#define	QI_EXPIRED		-1	/* File not to be tried again */
+
+/* External references */
+
+extern	VOID	qindex_close(VOID);
+extern	VOID	qindex_done(PUCHAR);
+extern	BOOL	qindex_due(PUCHAR, ULONG, ULONG);
+extern	VOID	qindex_envelope(PUCHAR, PUCHAR, INT);
+extern	LONG	qindex_failed(PUCHAR, PUCHAR);
+extern	VOID	qindex_mark(VOID);
+extern	ULONG	qindex_next(VOID);
+extern	VOID	qindex_open(PFL);
+extern	VOID	qindex_sweep(VOID);
+
+/*
+ * End of file: qindex.h
+ *
+ */
+
+
\ No newline at end of file
@@ -39,6 +39,77 @@
  *		were not being handled properly.
  *		Fixed problem when an unsupported authorisation method could be
  *		mistaken as supported.
+ *	4.6	Output to the server is now buffered, so that message text
+ *		is sent in full sized segments instead of a packet or two per
+ *		line. Write counts are logged at the end of each session.
+ *	4.7	Network input is now searched for line ends a block at a time,
+ *		using a larger (and configurable) buffer, and EHLO replies are
+ *		examined in place without being copied.
+ *	4.8	Network buffers and session state are now held in per-connection
+ *		structures rather than in static storage, so that more than one
+ *		session can be conducted by a single process.
+ *	5.0	Sessions are now driven by an event loop, with nonblocking
+ *		network I/O and per-session timeouts.
+ *	5.1	Message text that needs no alteration (lines ending in CR-LF,
+ *		and not beginning with a dot) is now sent a block at a time,
+ *		read straight into the network buffer.
+ *	5.2	Added -c option, to send messages over several connections
+ *		to the server at once.
+ *	5.3	Added support for the PIPELINING extension; envelope commands
+ *		are sent together, and the next message is started without
+ *		waiting for the reply to the end of the last one.
+ *	5.4	Added support for the CHUNKING extension; message text is
+ *		sent using BDAT, in chunks of increasing size up to a limit
+ *		set by the new -b option.
+ *	5.5	A message that is refused no longer disrupts the session;
+ *		the transaction is cleared with RSET, and the outcome of
+ *		each message is logged.
+ *	5.6	Added support for STARTTLS (when built with TLS=1), with new -t
+ *		option to require it. TLS sessions are cached on disk, so that
+ *		later connections can resume them; handshake counts and times
+ *		are logged.
+ *	5.7	BDAT chunks are now sent straight from the chunk buffer, rather
+ *		than being copied into the output buffer; over TLS, they go in
+ *		records of the largest size.
+ *	5.8	Mail files are now read in large blocks, with the envelope
+ *		parsed in place and the text sent in spans; there is no longer
+ *		any limit on the length of a line.
+ *	5.9	Message text is now searched for line ends a word at a time,
+ *		rather than a byte at a time.
+ *	6.0	The next few mail files are now opened and read by a separate
+ *		thread while messages are being sent; mail files are opened for
+ *		sequential access.
+ *	6.1	Spool directories are now read in large batches, and the files
+ *		can be sent oldest first (-ot) or smallest first (-os).
+ *	6.2	The spool is now searched only once; the search starts while
+ *		the connections are being made, and small files are read
+ *		into buffers sized to fit.
+ *	6.3	Added -w option, to run as a daemon; new mail is sent as it
+ *		arrives, over connections kept open while idle.
+ *	6.4	Added -g option, to gather mail into batches before connecting,
+ *		when running as a daemon; the work done by each batch, and the
+ *		time mail was held, are logged.
+ *	6.5	Added a queue index in each spool directory, recording the
+ *		attempts made to send each message; a message that could not
+ *		be sent is not tried again for 15 minutes.
+ *	6.6	Messages that could not be sent are retried after waits that
+ *		double each time, with a random element, and are given up
+ *		after five days.
+ *	6.7	Mail refused for good (5xx), or queued for too long, is now
+ *		moved to a DEAD subdirectory of the spool directory, with
+ *		the last reply from the server beside it.
+ *	6.8	Several copies of the program can now share one spool
+ *		directory; each message is claimed by moving it to a work
+ *		area of the process sending it, and messages left by a
+ *		process that has stopped are recovered.
+ *	6.9	Added -f option, for a spool directory fanned out over two
+ *		levels of subdirectories named by hexadecimal digits.
+ *	6.10	Added version 2 of the mail file format, with a binary
+ *		header giving the size of the message text; the size is
+ *		passed to servers that support the SIZE extension.
+ *	6.11	Messages sent are recorded in a journal in the work area,
+ *		and removed in groups by a separate thread; messages in
+ *		the journal of a stopped process are not sent again.
  *
  */
 
@@ -47,9 +118,11 @@
 #pragma	alloc_text(a_init_seg, main)
 #pragma	alloc_text(a_init_seg, add_file)
 #pragma	alloc_text(a_init_seg, add_directory)
+#pragma	alloc_text(a_init_seg, add_fanout)
 #pragma	alloc_text(a_init_seg, fix_domain)
 #pragma	alloc_text(a_init_seg, error)
 #pragma	alloc_text(a_init_seg, log_connection)
+#pragma	alloc_text(a_init_seg, process_gather)
 #pragma	alloc_text(a_init_seg, putusage)
 
 #include <ctype.h>
@@ -60,6 +133,8 @@
 #include <time.h>
 #include <types.h>
 
+#define	INCL_DOSFILEMGR
+#define	INCL_DOSPROCESS
 #define	OS2
 #include <sys\socket.h>
 #include <netinet\in.h>
@@ -68,12 +143,36 @@
 #include <resolv.h>
 
 #include "smtp.h"
+#include "spool.h"
+#include "prefetch.h"
+#include "engine.h"
+#ifdef	TLS
+#include "tls.h"
+#endif
 
 #define	LOGFILE		"SMTP.Log"	/* Name of log file */
 #define	LOGENV		"ETC"		/* Environment variable for log dir */
 #define	SMTPDIR		"SMTP"		/* Environment variable for spool dir */
+#define	TLSCACHE	"SMTP.TLS"	/* Name of TLS session cache file; kept
+					   in the log directory */
 #define	SMTPSERVICE	"smtp"		/* Name of SMTP service */
 #define	TCP		"tcp"		/* TCP protocol */
+#define	RECONNECT	60		/* Wait before trying to connect
+					   again, when running as a daemon
+					   (secs) */
+#define	RECONNECTMAX	3600		/* Longest such wait, after repeated
+					   failures (secs) */
+#define	GATHERTICK	250		/* Interval between counts of mail
+					   waiting, while gathering (ms) */
+#define	DEFGATHERMAX	60		/* Default longest time to gather
+					   mail (secs) */
+#define	DEFGATHERCOUNT	100		/* Default number of messages for
+					   which to stop gathering */
+#define	MAXMES		100		/* Maximum log message length */
+#define	MAXNUM		20		/* Longest number, in decimal, that
+					   may be added to a log message */
+#define	FANOUT		16		/* Subdirectories at each level of a
+					   fanned out spool directory */
 
 /* Type definitions */
 
@@ -86,15 +185,32 @@ typedef	struct servent		SERV, *PSERV;		/* Service structure */
 /* Forward references */
 
 static	VOID	add_directory(PUCHAR);
+static	VOID	add_fanout(PUCHAR);
 static	VOID	add_file(PUCHAR);
+static	VOID	backoff(PULONG);
+static	INT	connect_server(PSOCK, PUCHAR, PINT, INT);
 static	VOID	fix_domain(PUCHAR);
+static	ULONG	gather(PINT);
+static	VOID	log_batch(PRESULT, INT, ULONG);
 static	VOID	log_connection(PUCHAR, BOOL);
+static	VOID	process_gather(PUCHAR);
 static	VOID	process_logging(PUCHAR);
+static	VOID	process_order(PUCHAR);
 static	VOID	putusage(VOID);
 
 /* Local storage */
 
 static	LOGTYPE	log_type = LOGGING_UNSET;
+static	INT	order = -1;		/* Order of files in directories */
+static	INT	gathermin = -1;		/* Quiet time that ends gathering of
+					   mail (secs), or -1 if none */
+static	INT	gathermax;		/* Longest time to gather mail
+					   (secs) */
+static	INT	gathercount;		/* Number of messages that ends
+					   gathering of mail */
+static	INT	batches;		/* Batches of mail sent */
+static	ULONG	heldtotal;		/* Total time mail held, gathering */
+static	ULONG	heldmax;		/* Longest time mail held, gathering */
 static	PFL	head = (PFL) NULL;	/* Head of file list */
 static	PFL	tail;
 static	PUCHAR	progname;		/* Name of program, as a string */
@@ -105,14 +221,27 @@ static	const	PUCHAR helpinfo[] = {
 "%s: SMTP client",
 "Synopsis: %s [options] [file...]",
 " Options:",
+"    -bn          send text in BDAT chunks of up to n Kbytes (default 64)",
+"    -cn          use n connections to the server at once (default 1)",
 "    -ddirectory  specify directory containing mail; all files are sent",
+"    -fdirectory  as -d, but mail may also be in subdirectories x\\y of it,",
+"                 where x and y are hexadecimal digits",
 "    -edomain     send ETRN for domain",
+"    -gq[,m[,n]]  with -w, gather mail until none arrives for q secs,",
+"                 for at most m secs (default 60) or n files (default 100)",
 "    -h           display this help",
+"    -od          send files in directory order (default)",
+"    -os          send smallest files first",
+"    -ot          send oldest files first",
 "    -ppass       specify password for authentication",
 "    -q           operate quietly",
 "    -sserver     specify address of SMTP server",
+#ifdef	TLS
+"    -t           require STARTTLS (default: use it if offered)",
+#endif
 "    -uuser       specify username for authentication",
 "    -v           verbose; display progress",
+"    -w           run as a daemon; wait for more mail to arrive",
 "    -zf          log to file (default)",
 "    -zs          log to SYSLOG",
 " ",
@@ -132,10 +261,25 @@ static	const	PUCHAR helpinfo[] = {
  */
 
 INT main(INT argc, PUCHAR argv[])
-{	INT sockno, rc;
-	INT i;
+{	INT rc;
+	INT i, n;
+	INT nsocks = 0;
+	INT chunkmax = 0;
+#ifdef	TLS
+	INT tlsmode = TLS_TRY;
+#else
+	INT tlsmode = TLS_OFF;
+#endif
+	INT socks[MAXCONN];
 	BOOL verbose = FALSE;
 	BOOL quiet = FALSE;
+	BOOL watch = FALSE;
+	BOOL logging = FALSE;
+	INT gathered = 0;
+	ULONG held = 0;
+	ULONG pause = RECONNECT;
+	RESULT res;
+	PFL fp;
 	PUCHAR argp, p;
 	UCHAR servername[MAXDNAME+1];
 	UCHAR clientname[MAXDNAME+1];
@@ -169,6 +313,62 @@ INT main(INT argc, PUCHAR argv[])
 		argp = argv[i];
 		if(argp[0] == '-') {		/* Option */
 			switch(argp[1]) {
+				case 'b':	/* Maximum BDAT chunk size */
+					if(chunkmax != 0) {
+						error(
+							"chunk size specified"
+							" more than once");
+						exit(EXIT_FAILURE);
+					}
+					if(argp[2] != '\0') {
+						p = &argp[2];
+					} else {
+						if(i == argc - 1) {
+							error("no arg for -b");
+							exit(EXIT_FAILURE);
+						} else {
+							p = argv[++i];
+						}
+					}
+					chunkmax = atoi(p);
+					if(chunkmax < MINCHUNK ||
+					   chunkmax > MAXCHUNK) {
+						error(
+							"chunk size must be "
+							"from %d to %d",
+							MINCHUNK, MAXCHUNK);
+						exit(EXIT_FAILURE);
+					}
+					break;
+
+				case 'c':	/* Number of connections */
+					if(nsocks != 0) {
+						error(
+							"connection count "
+							"specified more than "
+							"once");
+						exit(EXIT_FAILURE);
+					}
+					if(argp[2] != '\0') {
+						p = &argp[2];
+					} else {
+						if(i == argc - 1) {
+							error("no arg for -c");
+							exit(EXIT_FAILURE);
+						} else {
+							p = argv[++i];
+						}
+					}
+					nsocks = atoi(p);
+					if(nsocks < 1 || nsocks > MAXCONN) {
+						error(
+							"connection count "
+							"must be from 1 to %d",
+							MAXCONN);
+						exit(EXIT_FAILURE);
+					}
+					break;
+
 				case 'd':	/* Specified directory */
 					if(argp[2] != '\0') {
 						add_directory(&argp[2]);
@@ -204,10 +404,63 @@ INT main(INT argc, PUCHAR argv[])
 					}
 					break;
 
+				case 'f':	/* Fanned out directory */
+					if(argp[2] != '\0') {
+						add_fanout(&argp[2]);
+					} else {
+						if(i == argc - 1) {
+							error("no arg for -f");
+							exit(EXIT_FAILURE);
+						} else {
+							add_fanout(argv[++i]);
+						}
+					}
+					break;
+
+				case 'g':	/* Gathering of mail */
+					if(gathermin != -1) {
+						error(
+							"gathering specified "
+							"more than once");
+						exit(EXIT_FAILURE);
+					}
+					if(argp[2] != '\0') {
+						process_gather(&argp[2]);
+					} else {
+						if(i == argc - 1) {
+							error("no arg for -g");
+							exit(EXIT_FAILURE);
+						} else {
+							i++;
+							process_gather(argv[i]);
+						}
+					}
+					break;
+
 				case 'h':	/* Display help */
 					putusage();
 					exit(EXIT_SUCCESS);
 
+				case 'o':	/* Order of files */
+					if(order != -1) {
+						error(
+							"order specified more "
+							"than once");
+						exit(EXIT_FAILURE);
+					}
+					if(argp[2] != '\0') {
+						process_order(&argp[2]);
+					} else {
+						if(i == argc - 1) {
+							error("no arg for -o");
+							exit(EXIT_FAILURE);
+						} else {
+							i++;
+							process_order(argv[i]);
+						}
+					}
+					break;
+
 				case 'p':	/* Specified password */
 					if(password[0] != '\0') {
 						error(
@@ -254,6 +507,12 @@ INT main(INT argc, PUCHAR argv[])
 					}
 					break;
 
+#ifdef	TLS
+				case 't':	/* Require STARTTLS */
+					tlsmode = TLS_MUST;
+					break;
+
+#endif
 				case 'u':	/* Specified username */
 					if(username[0] != '\0') {
 						error(
@@ -279,6 +538,10 @@ INT main(INT argc, PUCHAR argv[])
 					verbose = TRUE;
 					break;
 
+				case 'w':	/* Run as a daemon */
+					watch = TRUE;
+					break;
+
 				case 'z':	/* Logging */
 					if(log_type != LOGGING_UNSET) {
 						error(
@@ -323,7 +586,22 @@ INT main(INT argc, PUCHAR argv[])
 			error("cannot send mail at same time as ETRN");
 			exit(EXIT_FAILURE);
 		}
+		if(nsocks > 1) {
+			error("only one connection is needed for ETRN");
+			exit(EXIT_FAILURE);
+		}
+		if(watch == TRUE) {
+			error("cannot run as a daemon for ETRN");
+			exit(EXIT_FAILURE);
+		}
 	}
+	if(gathermin != -1 && watch == FALSE) {
+		error("-g can only be used when running as a daemon");
+		exit(EXIT_FAILURE);
+	}
+	if(nsocks == 0) nsocks = 1;
+	if(chunkmax == 0) chunkmax = DEFCHUNK;
+	if(order == -1) order = ORDER_DIR;
 
 	if((username[0] != '\0') && (password[0] == '\0') ||
 	   (username[0] == '\0') && (password[0] != '\0')) {
@@ -352,11 +630,25 @@ INT main(INT argc, PUCHAR argv[])
 			add_directory(temp);
 		}
 
-		/* Exit if nothing to do */
+		if(watch == TRUE) {
+			for(fp = head; fp != (PFL) NULL; fp = fp->next) {
+				if(fp->isdir == FALSE) {
+					error(
+						"only directories can be used"
+						" when running as a daemon");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+
+		/* Start looking for the files to send; this goes on while
+		   the connections are being made. Exit if nothing to do. */
 
-		if(something(head) == FALSE) {
+		prefetch_start(head, nsocks, order, watch);
+		if(watch == FALSE && prefetch_any() == FALSE) {
 			if(verbose == TRUE)
 				fprintf(stdout, "No mail to send\n");
+			prefetch_stop();
 			exit(EXIT_SUCCESS);
 		}
 	}
@@ -381,12 +673,7 @@ INT main(INT argc, PUCHAR argv[])
 	rc = sock_init();		/* Initialise socket library */
 	if(rc != 0) {
 		error("INET.SYS not running");
-		exit(EXIT_FAILURE);
-	}
-
-	sockno = socket(PF_INET, SOCK_STREAM, 0);
-	if(sockno == -1) {
-		error("cannot create socket");
+		prefetch_stop();
 		exit(EXIT_FAILURE);
 	}
 
@@ -398,6 +685,7 @@ INT main(INT argc, PUCHAR argv[])
 			error(
 				"cannot get address for SMTP server '%s'",
 				servername);
+			prefetch_stop();
 			exit(EXIT_FAILURE);
 		}
 	} else {
@@ -407,6 +695,7 @@ INT main(INT argc, PUCHAR argv[])
 	smtpserv = getservbyname(SMTPSERVICE, TCP);
 	if(smtpserv == (PSERV) NULL) {
 		error("cannot get port for %s/%s service", SMTPSERVICE, TCP);
+		prefetch_stop();
 		exit(EXIT_FAILURE);
 	}
 	endservent();
@@ -415,39 +704,242 @@ INT main(INT argc, PUCHAR argv[])
 	server.sin_family = AF_INET;
 	server.sin_addr.s_addr = server_addr;
 	server.sin_port = smtpserv->s_port;
-	rc = connect(sockno, (PSOCKG) &server, sizeof(SOCK));
-	if(rc == -1) {
-		error("cannot connect to SMTP server '%s'", servername);
-		exit(EXIT_FAILURE);
-	}
 
-	/* Start logging */
+	/* When running as a daemon, this goes on for ever; the connections
+	   are closed when idle for long enough, and made again when there
+	   is more mail. Each time, the mail may be gathered for a while
+	   first, so that a burst of it is sent over the same connections.
+	   If the server cannot be reached, or the sessions with it fail
+	   (it may be refusing mail for the time being), there is a wait
+	   before the next attempt, which doubles with each failure in a
+	   row; otherwise the mail still waiting would make it at once.
+	   A message that is deferred or refused does not count; the index
+	   decides when that is tried again. */
+
+	for(;;) {
+		if(watch == TRUE) {
+			prefetch_wait();
+			if(gathermin != -1) held = gather(&gathered);
+		}
+
+		n = connect_server(&server, servername, socks, nsocks);
+		if(n == 0) {
+			if(watch == FALSE) {
+				prefetch_stop();
+				exit(EXIT_FAILURE);
+			}
+			backoff(&pause);
+			continue;
+		}
+
+		/* Start logging */
 
-	rc = open_log(log_type, LOGENV, LOGFILE, clientname, progname);
-	if(rc != LOGERR_OK) {
-		error(
-		"logging initialisation failed - %s",
-		rc == LOGERR_NOENV    ? "environment variable "LOGENV" not set" :
-		rc == LOGERR_OPENFAIL ? "file open failed" :
+		if(logging == FALSE) {
+			rc = open_log(
+				log_type, LOGENV, LOGFILE, clientname,
+				progname);
+			if(rc != LOGERR_OK) {
+				error(
+				"logging initialisation failed - %s",
+				rc == LOGERR_NOENV    ?
+					"environment variable "LOGENV
+					" not set" :
+				rc == LOGERR_OPENFAIL ? "file open failed" :
 					"internal log type failure");
-		exit(EXIT_FAILURE);
-	}
+				prefetch_stop();
+				exit(EXIT_FAILURE);
+			}
+			logging = TRUE;
+#ifdef	TLS
+			if(tls_init(servername, getenv(LOGENV),
+					TLSCACHE) == FALSE) {
+				prefetch_stop();
+				exit(EXIT_FAILURE);
+			}
+#endif
+		}
+
+		log_connection(servername, quiet);
+
+		/* Do the work */
 
-	log_connection(servername, quiet);
+		rc = client(
+				socks, n, clientname, verbose, username,
+				password, domain, chunkmax*1024, tlsmode,
+				watch, &res);
 
-	/* Do the work */
+		for(i = 0; i < n; i++) (VOID) soclose(socks[i]);
+		if(watch == FALSE) break;
 
-	rc = client(
-			sockno, head, clientname, verbose,
-			username, password, domain);
+		/* Only mail arriving from now on counts towards the next
+		   batch; anything left is waiting to be retried */
 
-	(VOID) soclose(sockno);
+		prefetch_mark();
+		log_batch(&res, gathered, held);
+#ifdef	TLS
+		tls_batch();
+#endif
+
+		if(res.failed == FALSE)
+			pause = RECONNECT;
+		else
+			backoff(&pause);
+	}
+
+	if(domain[0] == 0) prefetch_stop();
+#ifdef	TLS
+	tls_term();
+#endif
 	close_log();
 
 	return(rc == TRUE ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 
+/*
+ * Wait for '*pausep' seconds before trying the server again, and double
+ * the wait for next time, up to RECONNECTMAX.
+ *
+ */
+
+static VOID backoff(PULONG pausep)
+{	(VOID) DosSleep(*pausep*1000);
+
+	*pausep *= 2;
+	if(*pausep > RECONNECTMAX) *pausep = RECONNECTMAX;
+}
+
+
+/*
+ * Make up to 'nsocks' connections to the SMTP server at 'server', placing
+ * the sockets in 'socks'. The server may limit the number it will accept,
+ * so carry on with as many as succeed.
+ *
+ * Returns the number of connections made; zero if none (reported).
+ *
+ */
+
+static INT connect_server(PSOCK server, PUCHAR servername, PINT socks,
+				INT nsocks)
+{	INT n, rc;
+
+	for(n = 0; n < nsocks; n++) {
+		socks[n] = socket(PF_INET, SOCK_STREAM, 0);
+		if(socks[n] == -1) {
+			error("cannot create socket");
+			break;
+		}
+		rc = connect(socks[n], (PSOCKG) server, sizeof(SOCK));
+		if(rc == -1) {
+			error("cannot connect to SMTP server '%s'",
+				servername);
+			(VOID) soclose(socks[n]);
+			break;
+		}
+	}
+
+	return(n);
+}
+
+
+/*
+ * Gather mail before connecting to the server, when running as a daemon.
+ * The first file has been found; the mail waiting is counted every
+ * GATHERTICK, until none has arrived for 'gathermin' seconds, or
+ * 'gathercount' files are waiting, or 'gathermax' seconds have passed.
+ * The number of files counted is returned via 'countp'.
+ *
+ * Returns the time spent gathering (ms).
+ *
+ */
+
+static ULONG gather(PINT countp)
+{	INT n, count = 0;
+	ULONG start, now, last;
+
+	start = engine_now();
+	last = start;
+	for(;;) {
+		n = prefetch_count(gathercount);
+		now = engine_now();
+		if(n > count) {
+			count = n;
+			last = now;
+		}
+		if(count >= gathercount ||
+		   now - last >= (ULONG) gathermin*1000 ||
+		   now - start >= (ULONG) gathermax*1000) break;
+		(VOID) DosSleep(GATHERTICK);
+	}
+	*countp = count;
+
+	return(now - start);
+}
+
+
+/*
+ * Log the work done by a batch of mail, when running as a daemon, as
+ * described by 'res'. If mail is being gathered, 'gathered' files were
+ * counted before connecting, and the first of them was held for 'held'
+ * ms; the average and longest times are logged too, so that the limits
+ * can be tuned.
+ *
+ */
+
+static VOID log_batch(PRESULT res, INT gathered, ULONG held)
+{	UCHAR mes[MAXMES+7*MAXNUM+1];	/* Text, and up to seven numbers */
+
+	batches++;
+	sprintf(mes, "[batch %d: %d message%s sent", batches,
+		res->msgcount, res->msgcount == 1 ? "" : "s");
+	if(res->deferred != 0)
+		sprintf(&mes[strlen(mes)], ", %d deferred", res->deferred);
+	if(res->unsent != 0)
+		sprintf(&mes[strlen(mes)], ", %d not sent", res->unsent);
+	if(gathermin != -1) {
+		sprintf(&mes[strlen(mes)], "; %d gathered in %lu ms",
+			gathered, held);
+	}
+	strcat(mes, "]");
+	dolog(LOG_INFO, mes);
+
+	if(gathermin == -1) return;
+	heldtotal += held;
+	if(held > heldmax) heldmax = held;
+	sprintf(mes, "[mail held for %lu ms on average, %lu ms at most, over"
+		" %d batch%s]", heldtotal/batches, heldmax, batches,
+		batches == 1 ? "" : "es");
+	dolog(LOG_INFO, mes);
+}
+
+
+/*
+ * Process the value of the '-g' option (gathering of mail). This is the
+ * quiet time in seconds, optionally followed by the longest time, and
+ * then the number of files, separated by commas.
+ *
+ */
+
+static VOID process_gather(PUCHAR s)
+{	PUCHAR p = s;
+
+	gathermax = DEFGATHERMAX;
+	gathercount = DEFGATHERCOUNT;
+	if(isdigit(*p)) {
+		gathermin = (INT) strtol(p, (char **) &p, 10);
+		if(gathermin > gathermax) gathermax = gathermin;
+		if(*p == ',' && isdigit(p[1]))
+			gathermax = (INT) strtol(p+1, (char **) &p, 10);
+		if(*p == ',' && isdigit(p[1]))
+			gathercount = (INT) strtol(p+1, (char **) &p, 10);
+		if(*p == '\0' && gathermax >= gathermin && gathermax > 0 &&
+		   gathercount > 0) return;
+	}
+	error("invalid value for -g option");
+	exit(EXIT_FAILURE);
+}
+
+
 /*
  * Process the value of the '-z' option (logging).
  *
@@ -470,6 +962,32 @@ static VOID process_logging(PUCHAR s)
 }
 
 
+/*
+ * Process the value of the '-o' option (order of sending).
+ *
+ */
+
+static VOID process_order(PUCHAR s)
+{	if(strlen(s) == 1) {
+		switch(toupper(s[0])) {
+			case 'D':	/* Directory order */
+				order = ORDER_DIR;
+				return;
+
+			case 'S':	/* Smallest first */
+				order = ORDER_SIZE;
+				return;
+
+			case 'T':	/* Oldest first */
+				order = ORDER_TIME;
+				return;
+		}
+	}
+	error("invalid value for -o option");
+	exit(EXIT_FAILURE);
+}
+
+
 /*
  * Add a filename to the file list.
  *
@@ -481,6 +999,8 @@ static VOID add_file(char *name)
 	temp->next = (PFL) NULL;
 	temp->name = name;
 	temp->isdir = FALSE;
+	temp->fanout = FALSE;
+	temp->root = (PFL) NULL;
 	strcpy(temp->name, name);
 	if(head == (PFL) NULL) {
 		head = temp;
@@ -503,6 +1023,8 @@ static VOID add_directory(char *name)
 	temp->next = (PFL) NULL;
 	temp->name = name;
 	temp->isdir = TRUE;
+	temp->fanout = FALSE;
+	temp->root = (PFL) NULL;
 	strcpy(temp->name, name);
 	if(head == (PFL) NULL) {
 		head = temp;
@@ -514,6 +1036,44 @@ static VOID add_directory(char *name)
 }
 
 
+/*
+ * Add a spool directory with a fanned out layout to the file list. Mail
+ * may be placed in the directory itself, as usual, or in any of the
+ * subdirectories x\y below it, where x and y are hexadecimal digits (for
+ * example, taken from a hash of the name of the file), so that no one
+ * directory gets too large. Each subdirectory is added to the list as a
+ * directory to be searched in its own right, and is made if it does not
+ * exist, so that it is there for mail to be placed in. The subdirectories
+ * share the queue index and work area of the directory itself (see
+ * qindex.c and claim.c), rather than each having its own.
+ *
+ */
+
+static VOID add_fanout(char *name)
+{	INT i, j;
+	PFL root;
+	PUCHAR sub;
+	static const UCHAR hex[] = "0123456789ABCDEF";
+
+	add_directory(name);
+	root = tail;
+	root->fanout = TRUE;
+
+	for(i = 0; i < FANOUT; i++) {
+		for(j = 0; j < FANOUT; j++) {
+			sub = (PUCHAR) xmalloc(strlen(name)+5);
+			if(sub == (PUCHAR) NULL) exit(EXIT_FAILURE);
+			sprintf(sub, "%s\\%c", name, hex[i]);
+			if(j == 0) (VOID) DosCreateDir(sub, (PEAOP2) NULL);
+			sprintf(sub, "%s\\%c\\%c", name, hex[i], hex[j]);
+			(VOID) DosCreateDir(sub, (PEAOP2) NULL);
+			add_directory(sub);
+			tail->root = root;
+		}
+	}
+}
+
+
 /*
  * Check for a full domain name; if not present, add default domain name.
  *
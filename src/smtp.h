@@ -13,14 +13,30 @@
 
 #include "log.h"
 
-#define	VERSION			4	/* Major version number */
-#define	EDIT			5	/* Edit number within major version */
+#define	VERSION			6	/* Major version number */
+#define	EDIT			11	/* Edit number within major version */
 
 #define	FALSE			0
 #define	TRUE			1
 
 #define	MAXUNAME		50	/* Maximum length of username */
 #define	MAXPASS			50	/* Maximum length of password */
+#define	MAXCONN			16	/* Maximum number of connections */
+#define	DEFCHUNK		64	/* Default maximum BDAT chunk (Kb) */
+#define	MINCHUNK		4	/* Smallest allowed maximum (Kb) */
+#define	MAXCHUNK		1024	/* Largest allowed maximum (Kb) */
+
+/* Use of STARTTLS */
+
+#define	TLS_OFF			0	/* Never used */
+#define	TLS_TRY			1	/* Used if the server offers it */
+#define	TLS_MUST		2	/* Required */
+
+/* Order in which the files in a directory are sent */
+
+#define	ORDER_DIR		0	/* Directory order */
+#define	ORDER_TIME		1	/* Oldest first */
+#define	ORDER_SIZE		2	/* Smallest first */
 
 /* Structure definitions */
 
@@ -28,13 +44,25 @@ typedef struct _FL {			/* Filename list cell */
 struct	_FL	*next;
 INT		isdir;
 PUCHAR		name;
+BOOL		fanout;			/* TRUE for a fanned out directory */
+struct	_FL	*root;			/* For a subdirectory of a fanned out
+					   directory, that directory;
+					   otherwise NULL */
 } FL, *PFL;
 
+typedef struct _RESULT {		/* Work done by a run of the client */
+INT		msgcount;		/* Messages sent */
+INT		deferred;		/* Messages deferred */
+INT		unsent;			/* Messages not sent */
+BOOL		failed;			/* TRUE if a session failed, rather
+					   than just some of its messages */
+} RESULT, *PRESULT;
+
 /* External references */
 
 extern	VOID	error(PUCHAR mes, ...);
-extern	BOOL	client(INT, PFL, PUCHAR, BOOL, PUCHAR, PUCHAR, PUCHAR);
-extern	BOOL	something(PFL);
+extern	BOOL	client(PINT, INT, PUCHAR, BOOL, PUCHAR, PUCHAR, PUCHAR,
+			INT, INT, BOOL, PRESULT);
 extern	PVOID	xmalloc(size_t);
 
 /*
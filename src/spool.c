@@ -0,0 +1,635 @@
+/*
+ * File: spool.c
+ *
+ * Block reader for mail files in the spool directory.
+ *
+ * A mail file holds the envelope (the MAIL, RCPT and DATA lines), then
+ * the message text. The file is read in large blocks. Envelope lines are
+ * returned in place, in the buffer, and the text is returned as spans of
+ * the buffer that can be sent just as they are, so there is no limit on
+ * the length of a line of text. The file is opened for sequential access,
+ * so that the system reads ahead of what has been asked for; the first
+ * block can also be read in advance (see 'spool_preload'), by a thread
+ * that works ahead of the one sending the messages.
+ *
+ * The text is put into canonical form on the way: a carriage return is
+ * supplied for any line that ends in a linefeed alone, a line starting
+ * with a dot can be dot-stuffed, and an end of file character at the
+ * start of a line ends the text. The extra characters are returned as
+ * spans of their own.
+ *
+ * A mail file may also start with a fixed header (see spool.h), written
+ * by a program that knows about it; this is version 2 of the format, and
+ * a file without one is taken to be version 1. The header gives the size
+ * of the text, which then ends there rather than at an end of file
+ * character, and says whether it is already in canonical form; if it is,
+ * and needs no dot-stuffing, it is sent without being examined at all.
+ * The header is checked against the size of the file before anything is
+ * read, and against the envelope once that has been read (see
+ * 'spool_envelope'), so that a file with a damaged header is never sent.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#pragma	strings(readonly)
+
+#pragma	alloc_text(a_init_seg, spool_open)
+
+#define	INCL_DOSERRORS
+#define	INCL_DOSFILEMGR
+#define	OS2
+#include <os2.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spool.h"
+
+#define	DEFBUFSIZE	32768		/* Default size of file buffer */
+#define	EOFCHAR		0x1a		/* Marks end of a text file */
+
+#define	ONES		((ULONG) ~0 / 0xff)	/* 0x01 in every byte */
+#define	HIGHS		(ONES * 0x80)		/* 0x80 in every byte */
+#define	LFWORD		(ONES * '\n')		/* Linefeed in every byte */
+
+/* Forward references */
+
+static	VOID	advance(PSPOOL, UCHAR);
+static	INT	fill(PSPOOL);
+static	PUCHAR	findlf(PUCHAR, PUCHAR);
+static	VOID	header(PSPOOL);
+static	INT	literal(PSPOOL, const UCHAR *, PUCHAR *);
+static	INT	readfile(PSPOOL, PUCHAR, INT);
+static	VOID	restore(PSPOOL);
+static	INT	scan(PSPOOL, PUCHAR, INT, BOOL);
+
+/* Local storage */
+
+static	const	UCHAR	dot[] = ".";
+static	const	UCHAR	cret[] = "\r";
+static	const	UCHAR	crlf[] = "\r\n";
+
+
+/*
+ * Open the mail file 'name' for reading. The size of the file buffer may
+ * be specified; zero selects the default. This is also the longest
+ * envelope line that 'spool_line' can return.
+ *
+ * Returns:
+ *	pointer to the context for the file, to be passed to the other
+ *	routines in this module
+ *	NULL on failure
+ *
+ */
+
+PSPOOL spool_open(PUCHAR name, INT size)
+{	PSPOOL sf;
+	APIRET rc;
+	ULONG action;
+
+	if(size <= 0) size = DEFBUFSIZE;
+
+	sf = (PSPOOL) malloc(sizeof(SPOOL));
+	if(sf == (PSPOOL) NULL) return((PSPOOL) NULL);
+	memset(sf, 0, sizeof(SPOOL));
+
+	sf->buf = (PUCHAR) malloc(size+2);	/* Room for line end and
+						   terminator */
+	if(sf->buf == (PUCHAR) NULL) {
+		free(sf);
+		return((PSPOOL) NULL);
+	}
+
+	rc = DosOpen(
+		name,
+		&sf->hf,
+		&action,
+		0,
+		FILE_NORMAL,
+		OPEN_ACTION_FAIL_IF_NEW | OPEN_ACTION_OPEN_IF_EXISTS,
+		OPEN_FLAGS_SEQUENTIAL | OPEN_FLAGS_NOINHERIT |
+			OPEN_SHARE_DENYNONE | OPEN_ACCESS_READONLY,
+		(PEAOP2) NULL);
+	if(rc != NO_ERROR) {
+		free(sf->buf);
+		free(sf);
+		return((PSPOOL) NULL);
+	}
+
+	sf->bufsize = size;
+	sf->held = -1;
+	sf->bol = TRUE;
+
+	return(sf);
+}
+
+
+/*
+ * Close a mail file, and release its context.
+ *
+ */
+
+VOID spool_close(PSPOOL sf)
+{	if(sf == (PSPOOL) NULL) return;
+
+	(VOID) DosClose(sf->hf);
+	free(sf->buf);
+	free(sf);
+}
+
+
+/*
+ * Read the first block of a mail file that has just been opened, so that
+ * it is ready before it is needed. Any error is reported again when the
+ * data is asked for.
+ *
+ */
+
+VOID spool_preload(PSPOOL sf)
+{	if(sf->count == 0) (VOID) fill(sf);
+}
+
+
+/*
+ * Get the next envelope line from the mail file, without copying it. A
+ * pointer to the line, which is left in the buffer, is returned via
+ * 'linep'. Carriage return, linefeed sequence is replaced by a linefeed,
+ * and the line is null terminated. The line remains valid only until the
+ * next call on this module for the same file.
+ *
+ * Returns:
+ *	> 0			length of line
+ *	0			end of file
+ *	SPOOL_TOOLONG		line too long for buffer
+ *	SPOOL_FORMAT		file has a header of an unknown format
+ *	SPOOL_ERR		read error
+ *
+ */
+
+INT spool_line(PSPOOL sf, PUCHAR *linep)
+{	INT len, n;
+	PUCHAR start, end;
+
+	restore(sf);
+	if(sf->badformat == TRUE) return(SPOOL_FORMAT);
+	if(sf->done == TRUE) return(0);
+
+	for(;;) {
+		start = &sf->buf[sf->next];
+		if(sf->count != 0 && start[0] == EOFCHAR) {
+			sf->done = TRUE;
+			return(0);
+		}
+
+		end = (PUCHAR) memchr(start, '\n', sf->count);
+		if(end != (PUCHAR) NULL) break;
+
+		if(sf->count == sf->bufsize) return(SPOOL_TOOLONG);
+		n = fill(sf);
+		if(n < 0) return(n);
+		if(n == 0) {		/* End of file */
+			if(sf->count == 0) return(0);
+			start = &sf->buf[sf->next];
+			end = &start[sf->count++];
+			end[0] = '\n';	/* Supply missing line end */
+			break;
+		}
+	}
+
+	len = end - start + 1;		/* Including the linefeed */
+	sf->next += len;
+	sf->count -= len;
+
+	if(len > 1 && end[-1] == '\r') {
+		end--;			/* Replace CR LF by LF */
+		end[0] = '\n';
+		len--;
+	}
+
+	sf->held = (end + 1) - sf->buf;	/* Terminate line in place */
+	sf->heldc = end[1];
+	end[1] = '\0';
+
+	*linep = start;
+
+	return(len);
+}
+
+
+/*
+ * Get the next span of message text, without copying it; this starts
+ * where the envelope ends. A pointer to the span is returned via 'spanp';
+ * the text there is in canonical form and, if 'dots' is TRUE, dot-stuffed.
+ * The span is not taken until 'spool_skip' is called, so if it cannot all
+ * be used at once, the rest is returned again by the next call. The span
+ * remains valid only until the next call on this module for the same file.
+ *
+ * Returns:
+ *	> 0			length of span
+ *	0			end of text
+ *	SPOOL_ERR		read error
+ *
+ */
+
+INT spool_span(PSPOOL sf, PUCHAR *spanp, BOOL dots)
+{	INT n;
+	PUCHAR p;
+
+	restore(sf);
+	if(sf->litlen != 0) {		/* Inserted text comes first */
+		*spanp = sf->lit;
+		return(sf->litlen);
+	}
+	if(sf->done == TRUE) return(0);
+
+	if(sf->count == 0) {
+		n = fill(sf);
+		if(n == SPOOL_ERR) return(SPOOL_ERR);
+		if(n == 0) {		/* End of file */
+			sf->done = TRUE;
+			if(sf->bol == TRUE) return(0);
+
+			/* The last line has no line end; supply one */
+
+			sf->bol = TRUE;
+			return(literal(
+				sf,
+				sf->cr == TRUE ? &crlf[1] : crlf,
+				spanp));
+		}
+	}
+
+	p = &sf->buf[sf->next];
+	n = scan(sf, p, sf->count, dots);
+	if(n != 0) {
+		*spanp = p;
+		return(n);
+	}
+
+	/* The first character needs attention */
+
+	if(p[0] == '\n') {		/* Linefeed alone; supply CR */
+		sf->cr = TRUE;
+		return(literal(sf, cret, spanp));
+	}
+	if(p[0] == '.') {		/* Dot-stuff */
+		sf->stuffed = TRUE;
+		return(literal(sf, dot, spanp));
+	}
+	sf->done = TRUE;		/* End of file character */
+
+	return(0);
+}
+
+
+/*
+ * Take the first 'len' bytes of the span last returned by 'spool_span'.
+ *
+ */
+
+VOID spool_skip(PSPOOL sf, INT len)
+{	if(len <= 0) return;
+
+	if(sf->litlen != 0) {		/* Inserted text */
+		sf->lit += len;
+		sf->litlen -= len;
+		return;
+	}
+
+	advance(sf, sf->buf[sf->next+len-1]);
+	sf->next += len;
+	sf->count -= len;
+}
+
+
+/*
+ * Copy message text, as returned by 'spool_span', into the buffer at 'p'
+ * until it is full ('size' bytes) or the text ends. When nothing is
+ * waiting in the file buffer, the file is read straight into the buffer
+ * at 'p', and the part that needs no attention is kept there; only the
+ * rest is copied into the file buffer, to be dealt with in the usual way.
+ *
+ * Returns:
+ *	>= 0			number of bytes placed; less than 'size'
+ *				only at the end of the text
+ *	SPOOL_ERR		read error
+ *
+ */
+
+INT spool_read(PSPOOL sf, PUCHAR p, INT size, BOOL dots)
+{	INT n, kept;
+	INT len = 0;
+	PUCHAR span;
+
+	while(len < size) {
+		if(sf->count == 0 && sf->litlen == 0 && sf->eof == FALSE &&
+		   sf->done == FALSE) {
+			n = size - len;
+			if(n > sf->bufsize) n = sf->bufsize;
+			restore(sf);
+			n = readfile(sf, &p[len], n);
+			if(n == SPOOL_ERR) return(SPOOL_ERR);
+			if(n == 0) continue;
+
+			kept = scan(sf, &p[len], n, dots);
+			if(kept != 0) advance(sf, p[len+kept-1]);
+			memcpy(sf->buf, &p[len+kept], n - kept);
+			sf->next = 0;
+			sf->count = n - kept;
+			len += kept;
+			continue;
+		}
+
+		n = spool_span(sf, &span, dots);
+		if(n == SPOOL_ERR) return(SPOOL_ERR);
+		if(n == 0) break;
+		if(n > size - len) n = size - len;
+		memcpy(&p[len], span, n);
+		spool_skip(sf, n);
+		len += n;
+	}
+
+	return(len);
+}
+
+
+/*
+ * Check, once the DATA line has been read by 'spool_line', that the
+ * envelope of a version 2 mail file agrees with its header: that it has
+ * 'rcpts' recipients, and that the text starts just after the DATA line.
+ * A file that does not is taken to be of an unknown format from then on,
+ * so that none of its text is sent.
+ *
+ * Returns:
+ *	TRUE		envelope agrees with header, or there is no header
+ *	FALSE		envelope does not agree with header
+ *
+ */
+
+BOOL spool_envelope(PSPOOL sf, INT rcpts)
+{	if(sf->version != SPOOL_V2) return(TRUE);
+
+	if(sf->rcpts == rcpts && sf->textoff == sf->pos - (ULONG) sf->count)
+		return(TRUE);
+	sf->badformat = TRUE;
+
+	return(FALSE);
+}
+
+
+/*
+ * Get the size of the message text, as given by the header of a version 2
+ * mail file. This is known once the first envelope line has been read.
+ *
+ * Returns the size, or 0 if it is not known.
+ *
+ */
+
+ULONG spool_size(PSPOOL sf)
+{	return(sf->size);
+}
+
+
+/*
+ * Find how much of the text at 'p' ('len' bytes, starting where the last
+ * text taken ended) can be sent as it is. That ends at a linefeed that
+ * is not preceded by a carriage return, or at the start of a line that
+ * begins with an end of file character (in a version 1 file) or (if
+ * 'dots' is TRUE, and it has not already been stuffed) a dot. Only the
+ * linefeeds, and the bytes either side of them, need to be examined; see
+ * 'findlf'. Text that is known to need no attention is not examined.
+ *
+ * Returns the number of bytes that can be sent unaltered; zero if the
+ * first one needs attention.
+ *
+ */
+
+static INT scan(PSPOOL sf, PUCHAR p, INT len, BOOL dots)
+{	PUCHAR q = p;
+	PUCHAR end = p + len;
+	BOOL eofc = sf->version == SPOOL_V2 ? FALSE : TRUE;
+
+	if((sf->flags & SF_CANONICAL) != 0 &&
+	   (dots == FALSE || (sf->flags & SF_NODOTS) != 0))
+		return(len);
+
+	if(sf->bol == TRUE) {
+		if(p[0] == EOFCHAR && eofc == TRUE) return(0);
+		if(p[0] == '.' && dots == TRUE && sf->stuffed == FALSE)
+			return(0);
+	}
+
+	for(;;) {
+		q = findlf(q, end);
+		if(q == end) break;
+		if(q == p ? sf->cr == FALSE : q[-1] != '\r')
+			return(q - p);	/* Linefeed alone */
+		if(++q == end) break;
+		if((q[0] == EOFCHAR && eofc == TRUE) ||
+		   (q[0] == '.' && dots == TRUE))
+			return(q - p);	/* Line needs attention */
+	}
+
+	return(len);
+}
+
+
+/*
+ * Find the first linefeed in the text from 'p' up to 'end'. Most of the
+ * text is examined a word at a time: after exclusive-ORing a word with a
+ * word of linefeeds, a linefeed shows up as a zero byte, and a zero byte
+ * can be detected by arithmetic on the whole word. Only the word that
+ * contains the linefeed, and any odd bytes at either end of the text, are
+ * examined a byte at a time.
+ *
+ * Returns a pointer to the linefeed, or 'end' if there is none.
+ *
+ */
+
+static PUCHAR findlf(PUCHAR p, PUCHAR end)
+{	ULONG w;
+
+	while(p < end && ((ULONG) p & (sizeof(ULONG)-1)) != 0) {
+		if(*p == '\n') return(p);
+		p++;			/* Not yet aligned */
+	}
+
+	while(end - p >= sizeof(ULONG)) {
+		w = *(PULONG) p ^ LFWORD;
+		if(((w - ONES) & ~w & HIGHS) != 0) break;
+		p += sizeof(ULONG);
+	}
+
+	while(p < end) {
+		if(*p == '\n') return(p);
+		p++;
+	}
+
+	return(end);
+}
+
+
+/*
+ * Note the position in the text after taking some of it; 'last' is the
+ * last byte taken.
+ *
+ */
+
+static VOID advance(PSPOOL sf, UCHAR last)
+{	sf->bol = last == '\n' ? TRUE : FALSE;
+	sf->cr = last == '\r' ? TRUE : FALSE;
+	sf->stuffed = FALSE;
+}
+
+
+/*
+ * Arrange for the text 's' to be inserted into the message text, and
+ * return it as the next span.
+ *
+ * Returns the length of the span.
+ *
+ */
+
+static INT literal(PSPOOL sf, const UCHAR *s, PUCHAR *spanp)
+{	sf->lit = (PUCHAR) s;
+	sf->litlen = strlen(s);
+	*spanp = sf->lit;
+
+	return(sf->litlen);
+}
+
+
+/*
+ * Read more of the file into the buffer, after any data already there
+ * (which is first moved to the front). The first time, the format of the
+ * file is found from what has been read.
+ *
+ * Returns:
+ *	> 0			number of bytes read
+ *	0			end of file
+ *	SPOOL_FORMAT		file has a header of an unknown format
+ *	SPOOL_ERR		read error
+ *
+ */
+
+static INT fill(PSPOOL sf)
+{	INT n;
+
+	if(sf->next != 0) {		/* Make room */
+		memmove(sf->buf, &sf->buf[sf->next], sf->count);
+		sf->next = 0;
+	}
+	if(sf->eof == TRUE) return(0);
+
+	n = readfile(sf, &sf->buf[sf->count], sf->bufsize - sf->count);
+	if(n == SPOOL_ERR) return(SPOOL_ERR);
+	sf->count += n;
+
+	if(sf->version == 0) {
+		header(sf);
+		if(sf->badformat == TRUE) return(SPOOL_FORMAT);
+	}
+
+	return(n);
+}
+
+
+/*
+ * Find the format of the file from its first block, which has just been
+ * read into the buffer. If it has a version 2 header, that is checked and
+ * then skipped, and reading is limited to the end of the text. The text
+ * must lie after the header, and within the file.
+ *
+ */
+
+static VOID header(PSPOOL sf)
+{	PSPOOLHDR hp = (PSPOOLHDR) sf->buf;
+	FILESTATUS3 fs;
+	APIRET rc;
+
+	sf->version = SPOOL_V1;
+	if(sf->count < sizeof(SPOOLHDR) ||
+	   memcmp(hp->magic, SPOOLMAGIC, sizeof(hp->magic)) != 0)
+		return;
+
+	rc = DosQueryFileInfo(sf->hf, FIL_STANDARD, &fs, sizeof(fs));
+	if(rc != NO_ERROR || hp->version != SPOOL_V2 ||
+	   hp->hdrsize < sizeof(SPOOLHDR) || hp->hdrsize > sf->count ||
+	   hp->textoff < hp->hdrsize || hp->textoff > fs.cbFile ||
+	   hp->textsize > fs.cbFile - hp->textoff || hp->rcpts == 0) {
+		sf->badformat = TRUE;
+		return;
+	}
+
+	sf->version = SPOOL_V2;
+	sf->flags = hp->flags;
+	sf->textoff = hp->textoff;
+	sf->rcpts = (INT) hp->rcpts;
+	sf->size = hp->textsize;
+	sf->end = hp->textoff + hp->textsize;
+	sf->next = hp->hdrsize;
+	sf->count -= hp->hdrsize;
+	if(sf->pos >= sf->end) {	/* Lose anything after the text */
+		sf->count -= sf->pos - sf->end;
+		sf->pos = sf->end;
+		sf->eof = TRUE;
+	}
+}
+
+
+/*
+ * Read up to 'size' bytes from the file into the buffer at 'p', but not
+ * beyond the end of the text, if that is known. Once a read has failed,
+ * every later one fails too.
+ *
+ * Returns:
+ *	> 0			number of bytes read
+ *	0			end of file
+ *	SPOOL_ERR		read error
+ *
+ */
+
+static INT readfile(PSPOOL sf, PUCHAR p, INT size)
+{	APIRET rc;
+	ULONG n;
+
+	if(sf->error == TRUE) return(SPOOL_ERR);
+	if(sf->end != 0 && (ULONG) size > sf->end - sf->pos)
+		size = (INT) (sf->end - sf->pos);
+	if(size == 0) {			/* End of text */
+		sf->eof = TRUE;
+		return(0);
+	}
+
+	rc = DosRead(sf->hf, p, size, &n);
+	if(rc != NO_ERROR) {
+		sf->error = TRUE;
+		return(SPOOL_ERR);
+	}
+	sf->pos += n;
+	if(n == 0) sf->eof = TRUE;
+
+	return((INT) n);
+}
+
+
+/*
+ * Restore the character overwritten by the terminator of the last line
+ * returned by 'spool_line'.
+ *
+ */
+
+static VOID restore(PSPOOL sf)
+{	if(sf->held >= 0) {
+		sf->buf[sf->held] = sf->heldc;
+		sf->held = -1;
+	}
+}
+
+/*
+ * End of file: spool.c
+ *
+ */
+
+
\ No newline at end of file
@@ -0,0 +1,99 @@
+/*
+ * File: spool.h
+ *
+ * Block reader for mail files in the spool directory; header file.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#define	FALSE			0
+#define	TRUE			1
+
+/* Error codes */
+
+#define	SPOOL_ERR		-1	/* Read error */
+#define	SPOOL_TOOLONG		-2	/* Line too long from spool_line() */
+#define	SPOOL_FORMAT		-3	/* Unknown format from spool_line() */
+
+/* Mail file formats */
+
+#define	SPOOL_V1		1	/* Envelope lines, then text */
+#define	SPOOL_V2		2	/* Header, then as version 1 */
+
+#define	SPOOLMAGIC		"\032SMTPQ\032"
+					/* Starts a version 2 file */
+
+/* Properties of the text of a version 2 file */
+
+#define	SF_CANONICAL		0x0001	/* Every line ends in CR LF, and
+					   there is no end of file
+					   character */
+#define	SF_NODOTS		0x0002	/* No line starts with a dot */
+
+/* Structure definitions */
+
+typedef struct _SPOOLHDR {		/* Header of a version 2 mail file */
+UCHAR		magic[8];		/* SPOOLMAGIC, null terminated */
+USHORT		version;		/* SPOOL_V2 */
+USHORT		hdrsize;		/* Size of header; the envelope
+					   follows it */
+USHORT		flags;			/* Properties of text (SF_xxx) */
+USHORT		rcpts;			/* Number of RCPT lines */
+ULONG		textoff;		/* Offset of message text, just after
+					   the DATA line */
+ULONG		textsize;		/* Size of message text */
+ULONG		reserved[2];		/* Zero */
+} SPOOLHDR, *PSPOOLHDR;
+
+typedef struct _SPOOL {			/* Mail file being read */
+HFILE		hf;			/* The file itself */
+INT		bufsize;		/* Size of file buffer */
+PUCHAR		buf;			/* File buffer */
+INT		next;			/* Offset of next byte in buffer */
+INT		count;			/* Bytes remaining in buffer */
+INT		held;			/* Offset of character overwritten by
+					   terminator of last line returned */
+UCHAR		heldc;			/* The overwritten character itself */
+BOOL		eof;			/* TRUE once end of file is reached */
+BOOL		error;			/* TRUE once a read has failed */
+BOOL		done;			/* TRUE once end of text is reached */
+BOOL		bol;			/* TRUE at the start of a line of
+					   text */
+BOOL		cr;			/* TRUE if the last byte of text was
+					   a carriage return */
+BOOL		stuffed;		/* TRUE if the dot starting this line
+					   has been stuffed */
+PUCHAR		lit;			/* Text to be inserted before the
+					   rest of the file */
+INT		litlen;			/* Length of that text */
+INT		version;		/* Format of file (SPOOL_Vx), or 0
+					   until the first block is read */
+BOOL		badformat;		/* TRUE if format is not known */
+USHORT		flags;			/* Properties of text (SF_xxx) */
+ULONG		size;			/* Size of text, or 0 if not known */
+ULONG		pos;			/* Bytes read from file so far */
+ULONG		end;			/* Offset of end of text, or 0 if it
+					   ends at the end of the file */
+ULONG		textoff;		/* Offset of text, from header */
+INT		rcpts;			/* Recipients, from header */
+} SPOOL, *PSPOOL;
+
+/* Spool file functions */
+
+extern	VOID	spool_close(PSPOOL);
+extern	INT	spool_line(PSPOOL, PUCHAR *);
+extern	BOOL	spool_envelope(PSPOOL, INT);
+extern	PSPOOL	spool_open(PUCHAR, INT);
+extern	VOID	spool_preload(PSPOOL);
+extern	INT	spool_read(PSPOOL, PUCHAR, INT, BOOL);
+extern	ULONG	spool_size(PSPOOL);
+extern	VOID	spool_skip(PSPOOL, INT);
+extern	INT	spool_span(PSPOOL, PUCHAR *, BOOL);
+
+/*
+ * End of file: spool.h
+ *
+ */
+
+
\ No newline at end of file
@@ -0,0 +1,341 @@
+/*
+ * File: tls.c
+ *
+ * TLS support (used with STARTTLS), with a session cache kept on disk.
+ *
+ * A full TLS handshake costs several round trips and a good deal of
+ * computation; resuming an earlier session costs much less. The session
+ * negotiated with a server is therefore kept, and saved in a file after
+ * each batch of connections (when running as a daemon, the program may
+ * never end), so that later connections to the same server (in this run,
+ * or the next) can resume it. The file holds one entry per server.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+#pragma	strings(readonly)
+
+#pragma	alloc_text(a_init_seg, tls_init)
+#pragma	alloc_text(a_init_seg, load_cache)
+
+#define	OS2
+#include <os2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl\ssl.h>
+
+#include "smtp.h"
+#include "tls.h"
+
+#define	MAXNAME		256		/* Longest server name in cache */
+#define	MAXSESS		8192		/* Largest saved session in cache */
+
+/* Forward references */
+
+static	VOID	load_cache(VOID);
+static	INT	new_session(SSL *, SSL_SESSION *);
+static	VOID	save_cache(VOID);
+
+/* Local storage */
+
+static	SSL_CTX		*ctx;		/* Context for all connections */
+static	SSL_SESSION	*cached;	/* Session to resume, or NULL */
+static	BOOL		changed;	/* TRUE if 'cached' needs saving */
+static	PUCHAR		server;		/* Name of server */
+static	UCHAR		cachefile[CCHMAXPATH+1];
+					/* Name of session cache file */
+static	INT		nfull;		/* Full handshakes done */
+static	INT		nresumed;	/* Sessions resumed */
+static	ULONG		tfull;		/* Total time for full handshakes */
+static	ULONG		tresumed;	/* Total time for resumed ones */
+
+
+/*
+ * Initialise TLS support, for connections to the server 'name'. The session
+ * cache is kept in the file 'file' in directory 'dir', and any session
+ * saved there for this server is loaded.
+ *
+ * Returns:
+ *	TRUE		initialised OK
+ *	FALSE		failed (reported)
+ *
+ */
+
+BOOL tls_init(PUCHAR name, PUCHAR dir, PUCHAR file)
+{	SSL_library_init();
+	SSL_load_error_strings();
+
+	ctx = SSL_CTX_new(SSLv23_client_method());
+	if(ctx == (SSL_CTX *) NULL) {
+		error("cannot initialise TLS");
+		return(FALSE);
+	}
+	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+	/* The server's certificate is checked against the default
+	   certificate store (if any), but only so that the result can be
+	   logged. Sessions are kept here, not in OpenSSL's own cache. */
+
+	(VOID) SSL_CTX_set_default_verify_paths(ctx);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	SSL_CTX_set_session_cache_mode(
+		ctx,
+		SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session);
+
+	server = name;
+	if(dir != (PUCHAR) NULL)
+		sprintf(cachefile, "%s\\%s", dir, file);
+	else
+		strcpy(cachefile, file);
+	load_cache();
+
+	return(TRUE);
+}
+
+
+/*
+ * Create a TLS connection structure for a new connection to the server,
+ * set up to resume the cached session if there is one. It is used by
+ * 'sock_starttls' (in netio.c), which frees it when the connection
+ * is closed.
+ *
+ * Returns:
+ *	pointer to the structure (an SSL *)
+ *	NULL on failure
+ *
+ */
+
+PVOID tls_new(VOID)
+{	SSL *ssl;
+
+	ssl = SSL_new(ctx);
+	if(ssl == (SSL *) NULL) return((PVOID) NULL);
+
+	(VOID) SSL_set_tlsext_host_name(ssl, server);
+	if(cached != (SSL_SESSION *) NULL)
+		(VOID) SSL_set_session(ssl, cached);
+
+	return((PVOID) ssl);
+}
+
+
+/*
+ * Note that the handshake on a connection has completed, taking 'ms'
+ * milliseconds, and log the details.
+ *
+ */
+
+VOID tls_started(PVOID p, ULONG ms)
+{	SSL *ssl = (SSL *) p;
+	BOOL reused;
+	UCHAR mes[MAXNAME+100];
+
+	reused = SSL_session_reused(ssl) ? TRUE : FALSE;
+	if(reused == TRUE) {
+		nresumed++;
+		tresumed += ms;
+	} else {
+		nfull++;
+		tfull += ms;
+	}
+
+	sprintf(
+		mes,
+		"[%s session %s in %lu ms%s]",
+		SSL_get_version(ssl),
+		reused == TRUE ? "resumed" : "established",
+		ms,
+		SSL_get_verify_result(ssl) == X509_V_OK ? "" :
+			"; certificate not verified");
+	dolog(LOG_INFO, mes);
+}
+
+
+/*
+ * Finish a batch of connections to the server; log the handshake
+ * statistics for the batch, and save the session in the cache file if it
+ * has changed.
+ *
+ */
+
+VOID tls_batch(VOID)
+{	UCHAR mes[200];
+
+	if(nfull + nresumed != 0) {
+		sprintf(
+			mes,
+			"[TLS handshakes: %d full, average %lu ms;"
+			" %d resumed, average %lu ms]",
+			nfull,
+			nfull == 0 ? 0 : tfull/nfull,
+			nresumed,
+			nresumed == 0 ? 0 : tresumed/nresumed);
+		dolog(LOG_INFO, mes);
+	}
+	nfull = 0;
+	nresumed = 0;
+	tfull = 0;
+	tresumed = 0;
+
+	if(changed == TRUE) {
+		save_cache();
+		changed = FALSE;
+	}
+}
+
+
+/*
+ * Finish with TLS; log the handshake statistics, and save the session in
+ * the cache file if it has changed.
+ *
+ */
+
+VOID tls_term(VOID)
+{	tls_batch();
+
+	if(cached != (SSL_SESSION *) NULL) SSL_SESSION_free(cached);
+	SSL_CTX_free(ctx);
+}
+
+
+/*
+ * Called by OpenSSL when a new session has been negotiated (or, with
+ * TLS 1.3, when a session ticket arrives). The newest session replaces
+ * the cached one.
+ *
+ * Returns 1 to keep the reference to the session.
+ *
+ */
+
+static INT new_session(SSL *ssl, SSL_SESSION *sess)
+{	if(cached != (SSL_SESSION *) NULL) SSL_SESSION_free(cached);
+	cached = sess;
+	changed = TRUE;
+
+	return(1);
+}
+
+
+/*
+ * Load the cached session for the server, if there is one and it has not
+ * expired. The cache file is a sequence of entries, each consisting of a
+ * line giving the server name, then the length of the saved session (as
+ * a ULONG), then the session itself.
+ *
+ */
+
+static VOID load_cache(VOID)
+{	FILE *fp;
+	ULONG len;
+	const UCHAR *p;
+	UCHAR name[MAXNAME+2];
+	UCHAR buf[MAXSESS];
+
+	fp = fopen(cachefile, "rb");
+	if(fp == (FILE *) NULL) return;	/* No cache yet */
+
+	while(fgets(name, sizeof(name), fp) != (PUCHAR) NULL) {
+		name[strlen(name)-1] = '\0';	/* Lose newline */
+		if(fread(&len, sizeof(len), 1, fp) != 1 || len > MAXSESS)
+			break;
+		if(fread(buf, 1, len, fp) != len) break;
+		if(stricmp(name, server) != 0) continue;
+
+		p = buf;
+		cached = d2i_SSL_SESSION((SSL_SESSION **) NULL, &p, len);
+		if(cached != (SSL_SESSION *) NULL &&
+		   SSL_SESSION_get_time(cached) +
+		   SSL_SESSION_get_timeout(cached) < time((time_t *) NULL)) {
+			SSL_SESSION_free(cached);	/* Expired */
+			cached = (SSL_SESSION *) NULL;
+		}
+		break;
+	}
+
+	(VOID) fclose(fp);
+}
+
+
+/*
+ * Save the cached session for the server. The cache file is rewritten,
+ * keeping the entries for other servers.
+ *
+ */
+
+static VOID save_cache(VOID)
+{	FILE *fp;
+	ULONG len;
+	PUCHAR p, q, old;
+	INT n, size;
+	UCHAR name[MAXNAME+2];
+
+	/* Read the whole of the old file, if there is one */
+
+	old = (PUCHAR) NULL;
+	size = 0;
+	fp = fopen(cachefile, "rb");
+	if(fp != (FILE *) NULL) {
+		(VOID) fseek(fp, 0L, SEEK_END);
+		size = (INT) ftell(fp);
+		(VOID) fseek(fp, 0L, SEEK_SET);
+		old = (PUCHAR) xmalloc(size+1);
+		if(old == (PUCHAR) NULL ||
+		   fread(old, 1, size, fp) != size) size = 0;
+		(VOID) fclose(fp);
+	}
+
+	fp = fopen(cachefile, "wb");
+	if(fp == (FILE *) NULL) {
+		error("cannot write TLS session cache %s", cachefile);
+		if(old != (PUCHAR) NULL) free(old);
+		return;
+	}
+
+	/* Copy the entries for other servers */
+
+	p = old;
+	while(p != (PUCHAR) NULL && p < old + size) {
+		q = memchr(p, '\n', old + size - p);
+		if(q == (PUCHAR) NULL ||
+		   q + 1 + sizeof(len) > old + size) break;
+		memcpy(&len, q + 1, sizeof(len));
+		n = (q - p) + 1 + sizeof(len) + len;
+		if(p + n > old + size || q - p > MAXNAME) break;
+		memcpy(name, p, q - p);
+		name[q - p] = '\0';
+		if(stricmp(name, server) != 0) (VOID) fwrite(p, 1, n, fp);
+		p += n;
+	}
+	if(old != (PUCHAR) NULL) free(old);
+
+	/* Add the entry for this server */
+
+	n = i2d_SSL_SESSION(cached, (PUCHAR *) NULL);
+	if(n > 0 && n <= MAXSESS) {
+		p = (PUCHAR) xmalloc(n);
+		if(p != (PUCHAR) NULL) {
+			q = p;
+			(VOID) i2d_SSL_SESSION(cached, &q);
+			len = n;
+			fprintf(fp, "%s\n", server);
+			(VOID) fwrite(&len, sizeof(len), 1, fp);
+			(VOID) fwrite(p, 1, n, fp);
+			free(p);
+		}
+	}
+
+	(VOID) fclose(fp);
+}
+
+/*
+ * End of file: tls.c
+ *
+ */
+
+
\ No newline at end of file
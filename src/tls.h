@@ -0,0 +1,24 @@
+/*
+ * File: tls.h
+ *
+ * TLS support (used with STARTTLS), with a session cache kept on disk;
+ * header file.
+ *
+ * Bob Eager   December 2004
+ *
+ */
+
+/* External references */
+
+extern	VOID	tls_batch(VOID);
+extern	BOOL	tls_init(PUCHAR, PUCHAR, PUCHAR);
+extern	PVOID	tls_new(VOID);
+extern	VOID	tls_started(PVOID, ULONG);
+extern	VOID	tls_term(VOID);
+
+/*
+ * End of file: tls.h
+ *
+ */
+
+
\ No newline at end of file